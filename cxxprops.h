@@ -8,791 +8,5864 @@
 #define CXXPROPS_PROPERTIES_H
 
 #include <istream>
+#include <string>
+#include <string_view>
 #include <vector>
 #include <unordered_map>
 #include <memory>
+#include <memory_resource>
 #include <iostream>
 #include <sstream>
 #include <utility>
 #include <algorithm>
-#include <numeric>
+#include <cctype>
+#include <iterator>
+#include <type_traits>
+#include <stdexcept>
+#include <cstdint>
+#include <limits>
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <functional>
+#include <charconv>
+#include <initializer_list>
+#include <optional>
+
+#ifndef _WIN32
+extern char** environ;
+#endif
 
 namespace cxxprops
 {
+namespace detail
+{
+/** Dense index of an interned key */
+using KeyId = std::uint32_t;
+
+/** Dense index of an interned key segment */
+using SegmentId = std::uint32_t;
+
+/** Marks the absence of a key or segment */
+constexpr std::uint32_t NoKey = std::numeric_limits<std::uint32_t>::max();
+
+/** Initial state of the key hash */
+constexpr std::uint64_t HashSeed = 14695981039346656037ull;
+
 /**
- * Parses and renders property files. Comments, formatting and property order
- * are preserved, with new properties and comments appended.
- *
- * Pretty-formatting the output is also supported.
- *
- * There are some differences between cxxprops and Java property files:
- *
- *  - Input is utf8 input instead of latin1
- *  - Only '=' is used for property assignment, not ':'. This allows
- *    colons in keys, such as "host:name = 0.0.0.0"
- *  - Support for property templates to reduce duplication
- *  - Prefix blocks with arbitrary nesting is supported; e.g server.log.level = debug, etc
- *    is the same as:
+ * Hint that memory at an address will be read soon
+ */
+inline void prefetch(const void* address)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(address);
+#else
+    (void) address;
+#endif
+}
+
+/**
+ * @return The environment of the process as an array of "NAME=value" strings
+ */
+inline char** environment()
+{
+#ifdef _WIN32
+    return _environ;
+#else
+    return environ;
+#endif
+}
+
+/**
+ * 64-bit FNV-1a. The returned state can be passed back in to continue
+ * hashing, so a key can be hashed piecewise.
+ */
+inline std::uint64_t hash(std::string_view str, std::uint64_t state = HashSeed)
+{
+    for (unsigned char ch : str)
+        state = (state ^ ch) * 1099511628211ull;
+
+    return state;
+}
+
+/**
+ * Open addressing hash index of dense ids. The owner of the ids stores the
+ * actual entries, and supplies the hash and an equality predicate.
+ */
+class IdIndex
+{
+public:
+
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+    explicit IdIndex(const allocator_type& alloc = {}) : slots(alloc)
+    {}
+
+    IdIndex(const IdIndex& other, const allocator_type& alloc) : slots(other.slots, alloc), used(other.used)
+    {}
+
+    /**
+     * @param h Hash of the entry to find
+     * @param match Called with candidate ids; returns true on a match
+     * @return Matching id, or NoKey
+     */
+    template <typename Match>
+    inline std::uint32_t find(std::uint64_t h, Match&& match) const
+    {
+        if (slots.empty())
+            return NoKey;
+
+        std::uint32_t t = tag(h);
+        std::size_t mask = slots.size() - 1;
+
+        for (std::size_t i = t & mask; slots[i].id != NoKey; i = (i + 1) & mask)
+        {
+            if (slots[i].tag == t && match(slots[i].id))
+                return slots[i].id;
+        }
+
+        return NoKey;
+    }
+
+    /**
+     * Prefetch the first slot probed by find(h)
+     */
+    inline void prefetch(std::uint64_t h) const
+    {
+        if (!slots.empty())
+            detail::prefetch(&slots[tag(h) & (slots.size() - 1)]);
+    }
+
+    /**
+     * Add an id which must not already be in the index
+     */
+    inline void insert(std::uint32_t id, std::uint64_t h)
+    {
+        if ((used + 1) * 4 > slots.size() * 3)
+            rehash(std::max<std::size_t>(16, slots.size() * 2));
+
+        place(id, tag(h));
+        used++;
+    }
+
+    /**
+     * Make room for a total number of ids without rehashing
+     */
+    inline void reserve(std::size_t count)
+    {
+        std::size_t capacity = std::max<std::size_t>(16, slots.size());
+        while (count * 4 > capacity * 3)
+            capacity *= 2;
+
+        if (capacity > slots.size())
+            rehash(capacity);
+    }
+
+    /**
+     * Remove all ids, keeping the capacity
+     */
+    inline void clear()
+    {
+        std::fill(slots.begin(), slots.end(), Slot{NoKey, 0});
+        used = 0;
+    }
+
+private:
+
+    struct Slot
+    {
+        std::uint32_t id;
+
+        /** High bits of the hash. These also determine the slot, so rehashing doesn't need the entries. */
+        std::uint32_t tag;
+    };
+
+    static inline std::uint32_t tag(std::uint64_t h)
+    {
+        return static_cast<std::uint32_t>(h >> 32);
+    }
+
+    inline void place(std::uint32_t id, std::uint32_t t)
+    {
+        std::size_t mask = slots.size() - 1;
+        std::size_t i = t & mask;
+
+        while (slots[i].id != NoKey)
+            i = (i + 1) & mask;
+
+        slots[i] = {id, t};
+    }
+
+    /**
+     * @param capacity New slot count, which must be a power of two
+     */
+    inline void rehash(std::size_t capacity)
+    {
+        std::pmr::vector<Slot> old(capacity, {NoKey, 0}, slots.get_allocator());
+        old.swap(slots);
+
+        for (const Slot& slot : old)
+        {
+            if (slot.id != NoKey)
+                place(slot.id, slot.tag);
+        }
+    }
+
+    std::pmr::vector<Slot> slots;
+    std::size_t used = 0;
+};
+
+/**
+ * Stores distinct strings back to back in a single buffer, referred to by a dense id.
+ */
+class StringPool
+{
+public:
+
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+    explicit StringPool(const allocator_type& alloc = {}) : bytes(alloc), entries(alloc), index(alloc)
+    {}
+
+    StringPool(const StringPool& other, const allocator_type& alloc)
+        : bytes(other.bytes, alloc), entries(other.entries, alloc), index(other.index, alloc)
+    {}
+
+    /**
+     * @return Id of the string, or NoKey if it hasn't been interned
+     */
+    inline std::uint32_t find(std::string_view str) const
+    {
+        return lookup(str, hash(str));
+    }
+
+    /**
+     * Find a string whose hash has already been computed
+     *
+     * @return Id of the string, or NoKey if it hasn't been interned
+     */
+    inline std::uint32_t lookup(std::string_view str, std::uint64_t h) const
+    {
+        return index.find(h, [&](std::uint32_t id) { return this->str(id) == str; });
+    }
+
+    /**
+     * @return Id of the string, which is added to the pool if missing
+     */
+    inline std::uint32_t intern(std::string_view str)
+    {
+        std::uint64_t h = hash(str);
+        std::uint32_t id = index.find(h, [&](std::uint32_t id) { return this->str(id) == str; });
+
+        if (id == NoKey)
+        {
+            id = static_cast<std::uint32_t>(entries.size());
+            entries.push_back({bytes.size(), str.size()});
+            bytes.append(str.data(), str.size());
+            index.insert(id, h);
+        }
+
+        return id;
+    }
+
+    /**
+     * @return The string. The view is invalidated when new strings are interned.
+     */
+    inline std::string_view str(std::uint32_t id) const
+    {
+        const Entry& entry = entries[id];
+        return std::string_view(bytes.data() + entry.offset, entry.length);
+    }
+
+    /**
+     * Remove all strings, keeping the capacity
+     */
+    inline void clear()
+    {
+        bytes.clear();
+        entries.clear();
+        index.clear();
+    }
+
+private:
+
+    struct Entry
+    {
+        std::size_t offset;
+        std::size_t length;
+    };
+
+    std::pmr::string bytes;
+    std::pmr::vector<Entry> entries;
+    IdIndex index;
+};
+
+/**
+ * Immutable, reference counted string. Copies share the same storage, so a value
+ * is never modified in place; assigning a new value leaves other holders of the
+ * old one unaffected. The empty value doesn't allocate.
+ */
+class Value
+{
+public:
+
+    Value() = default;
+
+    explicit Value(std::string_view str, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+    {
+        if (!str.empty())
+        {
+            rep = new (resource->allocate(sizeof(Rep) + str.size(), alignof(Rep))) Rep{{1}, str.size(), resource};
+            std::copy(str.begin(), str.end(), rep->data());
+        }
+    }
+
+    Value(const Value& other) noexcept : rep(other.rep)
+    {
+        if (rep)
+            rep->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    Value(Value&& other) noexcept : rep(other.rep)
+    {
+        other.rep = nullptr;
+    }
+
+    Value& operator=(Value other) noexcept
+    {
+        std::swap(rep, other.rep);
+        return *this;
+    }
+
+    ~Value()
+    {
+        if (rep && rep->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            std::pmr::memory_resource* resource = rep->resource;
+            std::size_t size = rep->size;
+
+            rep->~Rep();
+            resource->deallocate(rep, sizeof(Rep) + size, alignof(Rep));
+        }
+    }
+
+    inline std::string_view view() const
+    {
+        return rep ? std::string_view(rep->data(), rep->size) : std::string_view();
+    }
+
+    inline bool empty() const
+    {
+        return rep == nullptr;
+    }
+
+    /**
+     * @return true if both refer to the same storage, which implies equal values
+     */
+    inline bool sameAs(const Value& other) const
+    {
+        return rep == other.rep;
+    }
+
+private:
+
+    /** Header of the allocation; the characters follow it */
+    struct Rep
+    {
+        std::atomic<std::uint32_t> refs;
+        std::size_t size;
+
+        /** Resource the value was allocated from */
+        std::pmr::memory_resource* resource;
+
+        inline char* data()
+        {
+            return reinterpret_cast<char*>(this + 1);
+        }
+    };
+
+    Rep* rep = nullptr;
+};
+
+/**
+ * Hash-consing of values: interning a string returns a Value sharing the
+ * storage of any equal string interned before.
+ */
+class ValuePool
+{
+public:
+
+    explicit ValuePool(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : values(resource), index(std::pmr::polymorphic_allocator<char>(resource))
+    {}
+
+    inline Value intern(std::string_view str)
+    {
+        if (str.empty())
+            return Value();
+
+        std::uint64_t h = hash(str);
+        std::uint32_t id = index.find(h, [&](std::uint32_t id) { return values[id].view() == str; });
+
+        if (id == NoKey)
+        {
+            id = static_cast<std::uint32_t>(values.size());
+            values.emplace_back(str, values.get_allocator().resource());
+            index.insert(id, h);
+        }
+
+        return values[id];
+    }
+
+    /**
+     * Release the pool's references to all values, keeping the capacity
+     */
+    inline void clear()
+    {
+        values.clear();
+        index.clear();
+    }
+
+private:
+
+    std::pmr::vector<Value> values;
+    IdIndex index;
+};
+
+/**
+ * Maps strings to values, such as keys to environment overrides
+ */
+class StringMap
+{
+public:
+
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+    explicit StringMap(const allocator_type& alloc = {}) : keys(alloc), values(alloc)
+    {}
+
+    StringMap(const StringMap& other, const allocator_type& alloc)
+        : keys(other.keys, alloc), values(other.values, alloc)
+    {}
+
+    /**
+     * @param key Key to find
+     * @param h Hash of the key
+     * @return The value, or nullptr if the key isn't in the map
+     */
+    inline const Value* find(std::string_view key, std::uint64_t h) const
+    {
+        std::uint32_t id = keys.lookup(key, h);
+        return id == NoKey ? nullptr : &values[id];
+    }
+
+    /**
+     * Add or replace the value of a key
+     */
+    inline void set(std::string_view key, std::string_view value)
+    {
+        std::uint32_t id = keys.intern(key);
+        if (id >= values.size())
+            values.resize(id + 1);
+
+        values[id] = Value(value, values.get_allocator().resource());
+    }
+
+    inline std::size_t size() const
+    {
+        return values.size();
+    }
+
+    /**
+     * Remove all entries, keeping the capacity
+     */
+    inline void clear()
+    {
+        keys.clear();
+        values.clear();
+    }
+
+private:
+
+    StringPool keys;
+    std::pmr::vector<Value> values;
+};
+
+/**
+ * Stores each distinct key exactly once, as a path of interned segments.
  *
- *      server
- *      {
- *          port = 1234
- *          log.level = debug
- *      }
+ * A key such as "backend.database.log.level" is a node holding the segment "level"
+ * and a link to its parent "backend.database.log". Keys sharing a prefix share its
+ * nodes, and every segment string is stored once no matter how many keys use it.
  *
- * See also http://docs.oracle.com/javase/8/docs/api/java/util/Properties.html
+ * Each node also records the hash of its full dotted key, which continues the hash
+ * of its parent. A key is therefore found with a single probe without ever building
+ * the full string, and the match is verified segment by segment.
  */
-class Properties
+class KeyPool
 {
 public:
 
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+    explicit KeyPool(const allocator_type& alloc = {}) : segments(alloc), nodes(alloc), index(alloc)
+    {}
+
+    KeyPool(const KeyPool& other, const allocator_type& alloc)
+        : segments(other.segments, alloc), nodes(other.nodes, alloc), index(other.index, alloc)
+    {}
+
+    /**
+     * @return Id of the key, or NoKey if the key hasn't been interned
+     */
+    inline KeyId find(std::string_view key) const
+    {
+        return lookup(key, hash(key));
+    }
+
+    /**
+     * Find a key whose hash has already been computed
+     *
+     * @param key Dotted key
+     * @param h Hash of the key
+     * @return Id of the key, or NoKey if the key hasn't been interned
+     */
+    inline KeyId lookup(std::string_view key, std::uint64_t h) const
+    {
+        return index.find(h, [&](KeyId id) { return matches(id, key); });
+    }
+
+    /**
+     * Find a key below an ancestor, with a hash continued from the hash of the ancestor
+     *
+     * @param key Dotted key relative to the ancestor
+     * @param h Hash of the full key
+     * @param ancestor The ancestor key
+     * @return Id of the key, or NoKey if the key hasn't been interned
+     */
+    inline KeyId lookup(std::string_view key, std::uint64_t h, KeyId ancestor) const
+    {
+        return index.find(h, [&](KeyId id) { return matches(id, key, ancestor); });
+    }
+
+    /**
+     * Find a key given as parts, which are joined by dots
+     *
+     * @param parts Parts of the key, such as {"server", tenant, "level"}. A part may contain dots.
+     * @param count Number of parts, which must not be 0
+     * @param h Hash of the joined key
+     * @return Id of the key, or NoKey if the key hasn't been interned
+     */
+    inline KeyId lookup(const std::string_view* parts, std::size_t count, std::uint64_t h) const
+    {
+        return index.find(h, [&](KeyId id) { return matches(id, parts, count); });
+    }
+
+    /**
+     * Prefetch the index slot of a key about to be looked up
+     */
+    inline void prefetch(std::uint64_t h) const
+    {
+        index.prefetch(h);
+    }
+
+    /**
+     * Find a key relative to a parent key
+     *
+     * @param key Dotted key
+     * @param parent Parent key, or NoKey if key is fully qualified
+     * @return Id of the key, or NoKey if it hasn't been interned
+     */
+    inline KeyId find(std::string_view key, KeyId parent) const
+    {
+        if (parent == NoKey)
+            return find(key);
+
+        for (;;)
+        {
+            std::string_view::size_type dot = key.find('.');
+
+            parent = child(parent, key.substr(0, dot));
+            if (parent == NoKey || dot == std::string_view::npos)
+                return parent;
+
+            key.remove_prefix(dot + 1);
+        }
+    }
+
+    /**
+     * Find a single segment below a parent key
+     *
+     * @param parent Parent key, or NoKey to find a top level segment
+     * @param segment Segment, which must not contain dots
+     * @return Id of the child key, or NoKey if it hasn't been interned
+     */
+    inline KeyId child(KeyId parent, std::string_view segment) const
+    {
+        SegmentId seg = segments.find(segment);
+        if (seg == NoKey)
+            return NoKey;
+
+        return index.find(childHash(parent, segment),
+                          [&](KeyId id) { return nodes[id].parent == parent && nodes[id].segment == seg; });
+    }
+
+    /**
+     * Intern a key relative to a parent key
+     *
+     * @param key Dotted key
+     * @param parent Parent key, or NoKey if key is fully qualified
+     * @return Id of the key, which is added to the pool if missing
+     */
+    inline KeyId intern(std::string_view key, KeyId parent = NoKey)
+    {
+        KeyId id = parent;
+
+        for (;;)
+        {
+            std::string_view::size_type dot = key.find('.');
+            std::string_view segment = key.substr(0, dot);
+
+            std::uint64_t h = childHash(id, segment);
+            SegmentId seg = segments.intern(segment);
+            KeyId next = index.find(h, [&](KeyId cand) { return nodes[cand].parent == id && nodes[cand].segment == seg; });
+
+            if (next == NoKey)
+            {
+                next = static_cast<KeyId>(nodes.size());
+                nodes.push_back({id, seg, h});
+                index.insert(next, h);
+            }
+
+            id = next;
+
+            if (dot == std::string_view::npos)
+                return id;
+
+            key.remove_prefix(dot + 1);
+        }
+    }
+
+    /**
+     * @return Parent key, or NoKey for top level keys
+     */
+    inline KeyId parent(KeyId id) const
+    {
+        return nodes[id].parent;
+    }
+
+    /**
+     * @return Segment of the key below its parent
+     */
+    inline SegmentId segment(KeyId id) const
+    {
+        return nodes[id].segment;
+    }
+
+    /**
+     * @return The text of a segment
+     */
+    inline std::string_view segmentStr(SegmentId segment) const
+    {
+        return segments.str(segment);
+    }
+
+    /**
+     * @return Hash of the full dotted key, equal to hash(...) of the key string
+     */
+    inline std::uint64_t keyHash(KeyId id) const
+    {
+        return nodes[id].hash;
+    }
+
+    /**
+     * Append the dotted key to a string
+     *
+     * @param out String to append to
+     * @param id Key
+     * @param ancestor If set, only the part of the key below this ancestor is appended
+     */
+    template <typename String>
+    inline void append(String& out, KeyId id, KeyId ancestor = NoKey) const
+    {
+        std::size_t length = 0;
+        for (KeyId cur = id; cur != ancestor; cur = nodes[cur].parent)
+            length += segments.str(nodes[cur].segment).size() + 1;
+
+        if (length == 0)
+            return;
+
+        std::size_t start = out.size();
+        out.resize(start + length - 1);
+
+        // Fill in from the end, as the chain is walked from the leaf
+        std::size_t pos = out.size();
+        for (KeyId cur = id; cur != ancestor; cur = nodes[cur].parent)
+        {
+            std::string_view seg = segments.str(nodes[cur].segment);
+            pos -= seg.size();
+            out.replace(pos, seg.size(), seg.data(), seg.size());
+
+            if (pos > start)
+                out[--pos] = '.';
+        }
+    }
+
+    /**
+     * @return The dotted key, relative to ancestor if set
+     */
+    inline std::string str(KeyId id, KeyId ancestor = NoKey) const
+    {
+        std::string res;
+        append(res, id, ancestor);
+        return res;
+    }
+
+    /**
+     * @return Number of interned keys, including prefixes
+     */
+    inline std::size_t size() const
+    {
+        return nodes.size();
+    }
+
+    /**
+     * Make room for a number of additional keys, including prefixes
+     */
+    inline void reserve(std::size_t count)
+    {
+        nodes.reserve(nodes.size() + count);
+        index.reserve(nodes.size() + count);
+    }
+
+    /**
+     * Remove all keys, keeping the capacity
+     */
+    inline void clear()
+    {
+        segments.clear();
+        nodes.clear();
+        index.clear();
+    }
+
+private:
+
+    struct Node
+    {
+        KeyId parent;
+        SegmentId segment;
+
+        /** Hash of the full dotted key */
+        std::uint64_t hash;
+    };
+
+    /**
+     * @return Hash of the full key of a segment below parent
+     */
+    inline std::uint64_t childHash(KeyId parent, std::string_view segment) const
+    {
+        return parent == NoKey ? hash(segment) : hash(segment, hash(".", nodes[parent].hash));
+    }
+
+    /**
+     * @return True if the dotted key equals the key with the given id, compared segment by segment from the end
+     * @param ancestor If set, the key is relative to this ancestor
+     */
+    inline bool matches(KeyId id, std::string_view key, KeyId ancestor = NoKey) const
+    {
+        for (;;)
+        {
+            const Node& node = nodes[id];
+            std::string_view seg = segments.str(node.segment);
+
+            if (node.parent == ancestor)
+                return key == seg;
+
+            if (node.parent == NoKey)
+                return false;
+
+            if (key.size() <= seg.size()
+                || key[key.size() - seg.size() - 1] != '.'
+                || key.substr(key.size() - seg.size()) != seg)
+                return false;
+
+            key.remove_suffix(seg.size() + 1);
+            id = node.parent;
+        }
+    }
+
+    /**
+     * @return True if the parts joined by dots equal the key with the given id
+     */
+    inline bool matches(KeyId id, const std::string_view* parts, std::size_t count) const
+    {
+        // Segments are compared from the end, consuming the parts from the last one
+        std::string_view part = parts[--count];
+
+        for (;;)
+        {
+            const Node& node = nodes[id];
+            std::string_view seg = segments.str(node.segment);
+
+            if (part.size() < seg.size() || part.substr(part.size() - seg.size()) != seg)
+                return false;
+
+            if (part.size() == seg.size())
+            {
+                if (node.parent == NoKey || count == 0)
+                    return node.parent == NoKey && count == 0;
+
+                part = parts[--count];
+            }
+            else
+            {
+                if (node.parent == NoKey || part[part.size() - seg.size() - 1] != '.')
+                    return false;
+
+                part.remove_suffix(seg.size() + 1);
+            }
+
+            id = node.parent;
+        }
+    }
+
+    StringPool segments;
+    std::pmr::vector<Node> nodes;
+    IdIndex index;
+};
+
+/**
+ * Blocked Bloom filter over key hashes. Each key sets three bits in a single
+ * 64-bit word, so a lookup reads one word. There are no false negatives, and
+ * with 16 bits per key about one absent key in a hundred passes the filter.
+ *
+ * Bits can't be cleared, so removed keys are only counted as stale. The owner
+ * rebuilds the filter from the remaining keys when it's full or mostly stale.
+ */
+class KeyFilter
+{
+public:
+
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+    explicit KeyFilter(const allocator_type& alloc = {}) : words(alloc)
+    {}
+
+    KeyFilter(const KeyFilter& other, const allocator_type& alloc)
+        : words(other.words, alloc), keys(other.keys), removed(other.removed)
+    {}
+
+    /**
+     * @return false if the key with hash h is certainly not in the filter
+     */
+    inline bool mayContain(std::uint64_t h) const
+    {
+        if (words.empty())
+            return false;
+
+        std::uint64_t m = mix(h);
+        std::uint64_t bits = pattern(m);
+        return (words[(m >> 32) & (words.size() - 1)] & bits) == bits;
+    }
+
+    /**
+     * Prefetch the word checked by mayContain(h)
+     */
+    inline void prefetch(std::uint64_t h) const
+    {
+        if (!words.empty())
+            detail::prefetch(&words[(mix(h) >> 32) & (words.size() - 1)]);
+    }
+
+    /**
+     * Add a key. The filter must not be full.
+     */
+    inline void insert(std::uint64_t h)
+    {
+        std::uint64_t m = mix(h);
+        words[(m >> 32) & (words.size() - 1)] |= pattern(m);
+        keys++;
+    }
+
+    /**
+     * Record that a key has been removed
+     */
+    inline void erase()
+    {
+        removed++;
+    }
+
+    /**
+     * @return true if no more keys can be added without rebuilding
+     */
+    inline bool full() const
+    {
+        return keys >= capacity();
+    }
+
+    /**
+     * @return Number of keys the filter is sized for
+     */
+    inline std::size_t capacity() const
+    {
+        return words.size() * KeysPerWord;
+    }
+
+    /**
+     * @return Number of removed keys still set in the filter
+     */
+    inline std::size_t stale() const
+    {
+        return removed;
+    }
+
+    /**
+     * Remove all keys and size the filter for a number of keys
+     */
+    inline void reset(std::size_t capacity)
+    {
+        std::size_t count = 1;
+        while (count * KeysPerWord < capacity)
+            count *= 2;
+
+        words.assign(count, 0);
+        keys = 0;
+        removed = 0;
+    }
+
+    /**
+     * Remove all keys, keeping the capacity
+     */
+    inline void clear()
+    {
+        std::fill(words.begin(), words.end(), 0);
+        keys = 0;
+        removed = 0;
+    }
+
+private:
+
+    /** 16 bits per key */
+    static constexpr std::size_t KeysPerWord = 4;
+
+    static inline std::uint64_t mix(std::uint64_t h)
+    {
+        return (h ^ (h >> 29)) * 0x9e3779b97f4a7c15ULL;
+    }
+
+    /**
+     * @return Word with the three bits of a key set
+     */
+    static inline std::uint64_t pattern(std::uint64_t m)
+    {
+        return (1ULL << (m & 63)) | (1ULL << ((m >> 6) & 63)) | (1ULL << ((m >> 12) & 63));
+    }
+
+    std::pmr::vector<std::uint64_t> words;
+    std::size_t keys = 0;
+    std::size_t removed = 0;
+};
+
+/**
+ * Shares an object between copies of the holder until one of them updates it,
+ * at which point that holder gets its own copy. Objects are allocated from the
+ * holder's memory resource, and an empty holder reads as a default object.
+ *
+ * Holders of the same object may be used from different threads. The reference
+ * count is read with acquire ordering before an object is updated in place, so
+ * the update can't race with a holder on another thread that has just let go.
+ */
+template <typename T>
+class CowPtr
+{
+public:
+
+    explicit CowPtr(std::pmr::memory_resource* resource = std::pmr::get_default_resource()) : res(resource)
+    {}
+
+    CowPtr(const CowPtr& other) : block(other.block), res(other.res)
+    {
+        if (block)
+            block->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    CowPtr(CowPtr&& other) noexcept : block(other.block), res(other.res)
+    {
+        other.block = nullptr;
+    }
+
+    inline CowPtr& operator=(CowPtr other) noexcept
+    {
+        std::swap(block, other.block);
+        std::swap(res, other.res);
+        return *this;
+    }
+
+    ~CowPtr()
+    {
+        release();
+    }
+
+    inline const T& operator*() const
+    {
+        return block ? block->object() : empty();
+    }
+
+    inline const T* operator->() const
+    {
+        return &**this;
+    }
+
+    /**
+     * @return The object for updating, which is created or unshared first if needed
+     */
+    inline T& own()
+    {
+        if (!block)
+        {
+            block = create();
+        }
+        else if (shared())
+        {
+            Block* copy = create(block->object());
+            release();
+            block = copy;
+        }
+
+        return block->object();
+    }
+
+    /**
+     * @return True if other holders refer to the same object
+     */
+    inline bool shared() const
+    {
+        return block && block->refs.load(std::memory_order_acquire) > 1;
+    }
+
+    inline std::pmr::memory_resource* resource() const
+    {
+        return res;
+    }
+
+private:
+
+    /** The shared object and its reference count */
+    struct Block
+    {
+        explicit Block(std::pmr::memory_resource* resource) : refs(1), resource(resource)
+        {}
+
+        std::atomic<std::size_t> refs;
+
+        /** Resource the block was allocated from */
+        std::pmr::memory_resource* resource;
+
+        alignas(T) unsigned char storage[sizeof(T)];
+
+        inline T& object()
+        {
+            return *std::launder(reinterpret_cast<T*>(storage));
+        }
+    };
+
+    /**
+     * Allocate a block holding an object constructed from args, which gets the
+     * memory resource if it's allocator-aware
+     */
+    template <typename... Args>
+    inline Block* create(Args&&... args) const
+    {
+        std::pmr::polymorphic_allocator<Block> alloc(res);
+        Block* created = new (alloc.allocate(1)) Block(res);
+
+        try
+        {
+            std::pmr::polymorphic_allocator<T>(res).construct(reinterpret_cast<T*>(created->storage),
+                                                              std::forward<Args>(args)...);
+        }
+        catch (...)
+        {
+            created->~Block();
+            alloc.deallocate(created, 1);
+            throw;
+        }
+
+        return created;
+    }
+
+    /**
+     * Let go of the object, destroying it if this was the last holder
+     */
+    inline void release()
+    {
+        if (block && block->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            std::pmr::memory_resource* resource = block->resource;
+            block->object().~T();
+            block->~Block();
+            std::pmr::polymorphic_allocator<Block>(resource).deallocate(block, 1);
+        }
+
+        block = nullptr;
+    }
+
+    static inline const T& empty()
+    {
+        static const T instance;
+        return instance;
+    }
+
+    Block* block = nullptr;
+    std::pmr::memory_resource* res;
+};
+
+/**
+ * Vector with copy-on-write sharing between copies. Elements are stored in
+ * fixed size chunks, so copying the vector only shares its chunk table. When a
+ * copy updates or appends an element, the table and the one chunk holding the
+ * element are copied, while all other chunks remain shared.
+ */
+template <typename T>
+class CowVector
+{
+public:
+
+    static constexpr std::size_t ChunkBits = 8;
+    static constexpr std::size_t ChunkSize = std::size_t(1) << ChunkBits;
+
+    explicit CowVector(std::pmr::memory_resource* resource = std::pmr::get_default_resource()) : table(resource)
+    {}
+
+    CowVector(const CowVector&) = default;
+    CowVector& operator=(const CowVector&) = default;
+
+    CowVector(CowVector&& other) noexcept : table(std::move(other.table)), count(other.count)
+    {
+        other.count = 0;
+    }
+
+    CowVector& operator=(CowVector&& other) noexcept
+    {
+        table = std::move(other.table);
+        count = other.count;
+        other.count = 0;
+
+        return *this;
+    }
+
+    inline std::size_t size() const
+    {
+        return count;
+    }
+
+    inline const T& operator[](std::size_t pos) const
+    {
+        return (*(*table)[pos >> ChunkBits]).items[pos & (ChunkSize - 1)];
+    }
+
+    /**
+     * @return The element for updating, after unsharing its chunk
+     */
+    inline T& mutate(std::size_t pos)
+    {
+        return table.own()[pos >> ChunkBits].own().items[pos & (ChunkSize - 1)];
+    }
+
+    /**
+     * Append a default element
+     *
+     * @return The new element
+     */
+    inline T& emplace_back()
+    {
+        Table& chunks = table.own();
+        if ((count >> ChunkBits) == chunks.size())
+            chunks.emplace_back(table.resource());
+
+        T& item = mutate(count++);
+        item = T();
+
+        return item;
+    }
+
+    /**
+     * Grow the vector with default elements
+     */
+    inline void resize(std::size_t size)
+    {
+        while (count < size)
+            emplace_back();
+    }
+
+    inline void reserve(std::size_t size)
+    {
+        if (!table.shared())
+            table.own().reserve((size + ChunkSize - 1) >> ChunkBits);
+    }
+
+    /**
+     * Remove all elements. Chunks which aren't shared are kept for reuse.
+     */
+    inline void clear()
+    {
+        if (table.shared())
+        {
+            table = CowPtr<Table>(table.resource());
+        }
+        else
+        {
+            for (std::size_t pos = 0; pos < count; pos++)
+                mutate(pos) = T();
+        }
+
+        count = 0;
+    }
+
+    inline std::pmr::memory_resource* resource() const
+    {
+        return table.resource();
+    }
+
+private:
+
+    struct Chunk
+    {
+        T items[ChunkSize];
+    };
+
+    using Table = std::pmr::vector<CowPtr<Chunk>>;
+
+    CowPtr<Table> table;
+    std::size_t count = 0;
+};
+
+} // namespace detail
+
+/**
+ * Options controlling how Properties parses and stores its input.
+ */
+struct Options
+{
+    /**
+     * If true, only keys and decoded values are kept. No formatting information
+     * is recorded while parsing, which roughly halves memory usage and parse time
+     * for consumers that never call text(). Properties can still be updated and
+     * removed, but text() throws std::logic_error, and putEmptyLine() and
+     * putComment() are ignored.
+     */
+    bool readOnly = false;
+
+    /**
+     * If true, equal values share storage. This is worthwhile when values such as
+     * "true" or "debug" are repeated many times, or templates are expanded under
+     * many prefixes. Interning only happens while parsing; updating a property
+     * never affects other properties sharing its value.
+     */
+    bool internValues = false;
+
+    /**
+     * If true, references such as ${server.host} in values are replaced by the
+     * referenced value when read through get(...), getBool(...) or resolve(...).
+     * Values are expanded on first read and cached until a property they depend
+     * on changes. References to missing keys are left as-is, and cyclic
+     * references throw std::runtime_error.
+     *
+     * Since reading updates the cache, an instance must not be read concurrently
+     * when this is enabled. entries() and text() yield the values as written.
+     */
+    bool interpolate = false;
+
+    /**
+     * If not empty, parse(...) only keeps properties under one of these prefixes,
+     * such as "backend.database". Other keys are neither decoded nor stored, and
+     * prefix blocks which can't hold a wanted key are skipped as a whole. A prefix
+     * matches whole segments: "server" matches "server.host" but not "servers".
+     */
+    std::vector<std::string> include;
+
+    /**
+     * Prefixes of properties parse(...) skips, taking precedence over include.
+     *
+     * As the file isn't fully represented when filtering, text() and fileEntries()
+     * throw std::logic_error as in read-only mode.
+     */
+    std::vector<std::string> exclude;
+
+    /**
+     * If true, parse(...) only records where each top level prefix block starts
+     * and ends. A block is parsed the first time a key under its prefix is looked
+     * up, updated or removed, so opening a huge file is close to instant. Lookups
+     * return the same values as after a full parse. Iterating or counting the
+     * properties parses all remaining blocks, as does parsing another stream.
+     *
+     * The input is kept until all blocks are parsed. As reading may parse blocks,
+     * a lazy instance is not thread-safe even for const member functions, so it
+     * must not be read concurrently, such as through a shared const reference,
+     * until all blocks are parsed. Calling size() parses them. No lines are kept,
+     * so text() and fileEntries() throw std::logic_error as in read-only mode.
+     */
+    bool lazy = false;
+};
+
+class Properties;
+class Schema;
+struct Violation;
+
+/**
+ * Template definitions which are lexed once and shared by any number of
+ * Properties, such as templates used by many files, or by a file which is
+ * parsed over and over.
+ *
+ * A template variable referring to the library isn't expanded as text and
+ * parsed again. parse(...) adds the lexed lines of the template under the
+ * current prefix instead. The library is immutable once built, so it may be
+ * used by parses on several threads.
+ *
+ *     auto library = std::make_shared<cxxprops::TemplateLibrary>();
+ *     library->add(templateStream);
+ *
+ *     props.setTemplates(library);
+ *     props.parse(stream);
+ */
+class TemplateLibrary
+{
+public:
+
+    /**
+     * @param resource Memory resource for the lexed templates, including the values
+     *        which properties instantiated from them share. It must outlive the
+     *        library and all properties parsed with it.
+     */
+    explicit TemplateLibrary(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : names(resource), templates(resource)
+    {}
+
+    /**
+     * Add the template definitions of a stream. Other lines are ignored, and a
+     * definition replaces an earlier one with the same name.
+     *
+     * A block opened by a template must follow a key without a value, and be
+     * closed by the template. Templates can't include files, as a library isn't
+     * read from a file and has no directory to resolve them against. Otherwise
+     * std::runtime_error is thrown.
+     *
+     * @param stream Input stream with definitions such as <name> ... </name>
+     */
+    inline void add(std::istream& stream);
+
+    /**
+     * @return true if a template with the name is defined
+     */
+    inline bool contains(std::string_view name) const
+    {
+        return find(name) != nullptr;
+    }
+
+    /**
+     * @return Number of templates
+     */
+    inline std::size_t size() const
+    {
+        return templates.size();
+    }
+
+    /**
+     * @return The memory resource of the templates
+     */
+    inline std::pmr::memory_resource* resource() const
+    {
+        return templates.get_allocator().resource();
+    }
+
+private:
+
+    enum RecordType
+    {
+        Property, Comment, Empty, BlockStart, BlockEnd
+    };
+
+    /** A lexed line of a template body */
+    struct Record
+    {
+        explicit Record(std::pmr::memory_resource* resource) : key(resource)
+        {}
+
+        RecordType type = RecordType::Property;
+
+        /** The key of a property as written */
+        std::pmr::string key;
+
+        /** Decoded value of a property, shared by every property instantiated from it */
+        detail::Value value;
+
+        /**
+         * Position of the text of a comment in Template::text. For a property, the
+         * white spaces around the key and the value are stored back to back.
+         */
+        std::size_t offset = 0;
+        std::uint32_t length = 0;
+
+        std::uint32_t beforeKey = 0;
+        std::uint32_t afterKey = 0;
+        std::uint32_t beforeValue = 0;
+        std::uint32_t afterValue = 0;
+
+        bool lacksAssignment = false;
+
+        /** Number of continuation lines of the value */
+        std::uint32_t continuations = 0;
+    };
+
+    struct Template
+    {
+        explicit Template(std::pmr::memory_resource* resource) : records(resource), text(resource)
+        {}
+
+        std::pmr::vector<Record> records;
+
+        /** Text of the records, which parse(...) stores once rather than for every instantiation */
+        std::pmr::string text;
+
+        /** Whether the template has any properties, and if the last one lacks an assignment */
+        bool hasProperties = false;
+        bool lastLacksAssignment = false;
+    };
+
+    /**
+     * @return The template, or nullptr if it isn't defined
+     */
+    inline const Template* find(std::string_view name) const
+    {
+        std::uint32_t id = names.find(name);
+        return id == detail::NoKey ? nullptr : &templates[id];
+    }
+
+    /** Template names, with the same id as their entry in templates */
+    detail::StringPool names;
+    std::pmr::vector<Template> templates;
+
+    friend class Properties;
+};
+
+/**
+ * Parses and renders property files. Comments, formatting and property order
+ * are preserved, with new properties and comments appended.
+ *
+ * Pretty-formatting the output is also supported.
+ *
+ * There are some differences between cxxprops and Java property files:
+ *
+ *  - Input is utf8 input instead of latin1
+ *  - Only '=' is used for property assignment, not ':'. This allows
+ *    colons in keys, such as "host:name = 0.0.0.0"
+ *  - Support for property templates to reduce duplication
+ *  - Prefix blocks with arbitrary nesting is supported; e.g server.log.level = debug, etc
+ *    is the same as:
+ *
+ *      server
+ *      {
+ *          port = 1234
+ *          log.level = debug
+ *      }
+ *
+ * Const member functions may be called concurrently, except on an instance with
+ * Options::lazy blocks left to parse or with Options::interpolate set, where
+ * reading updates the instance.
+ *
+ * See also http://docs.oracle.com/javase/8/docs/api/java/util/Properties.html
+ */
+class Properties
+{
+public:
+
+    Properties() : Properties(Options())
+    {}
+
+    /**
+     * @param options Parse and storage options
+     * @param resource Memory resource for all storage owned by the properties, such as
+     *        a std::pmr::monotonic_buffer_resource for parse-then-discard workloads
+     */
+    explicit Properties(const Options& options,
+                        std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : keyPool(resource), props(resource), filter(resource), valuePool(resource),
+          lines(resource), lineText(resource), resolveNames(std::pmr::polymorphic_allocator<char>(resource)),
+          nameGenerations(resource), resolutions(resource), interpolations(resource), dependents(resource),
+          environment(resource), includes(resource), references(resource), lineRuns(resource), templateOffsets(resource),
+          blocks(resource), blockSegments(std::pmr::polymorphic_allocator<char>(resource)),
+          blockHeads(resource), prefixStack(resource),
+          inputBuffer(resource), valueBuffer(resource), lineBuffer(resource),
+          keyBuffer(resource), options(options)
+    {}
+
+    /**
+     * @param resource Memory resource for all storage owned by the properties
+     */
+    explicit Properties(std::pmr::memory_resource* resource) : Properties(Options(), resource)
+    {}
+
+    Properties(Properties&& other)
+        : keyPool(std::move(other.keyPool)), props(std::move(other.props)), filter(std::move(other.filter)),
+          count(std::exchange(other.count, 0)), valuePool(std::move(other.valuePool)), lines(std::move(other.lines)),
+          lineText(std::move(other.lineText)), resolveNames(std::move(other.resolveNames)),
+          nameGenerations(std::move(other.nameGenerations)), resolutions(std::move(other.resolutions)),
+          interpolations(std::move(other.interpolations)), dependents(std::move(other.dependents)),
+          environment(std::move(other.environment)), templateLibrary(std::move(other.templateLibrary)),
+          includes(std::move(other.includes)), references(std::move(other.references)),
+          lineRuns(std::move(other.lineRuns)), templateOffsets(std::move(other.templateOffsets)), blocks(std::move(other.blocks)),
+          blockSegments(std::move(other.blockSegments)), blockHeads(std::move(other.blockHeads)),
+          pendingBlocks(std::exchange(other.pendingBlocks, 0)), prefixStack(std::move(other.prefixStack)), inputBuffer(std::move(other.inputBuffer)),
+          valueBuffer(std::move(other.valueBuffer)), lineBuffer(std::move(other.lineBuffer)),
+          keyBuffer(std::move(other.keyBuffer)), options(other.options)
+    {}
+
+    Properties& operator=(Properties&& other)
+    {
+        keyPool = std::move(other.keyPool);
+        props = std::move(other.props);
+        filter = std::move(other.filter);
+        count = std::exchange(other.count, 0);
+        valuePool = std::move(other.valuePool);
+        lines = std::move(other.lines);
+        lineText = std::move(other.lineText);
+        resolveNames = std::move(other.resolveNames);
+        nameGenerations = std::move(other.nameGenerations);
+        resolutions = std::move(other.resolutions);
+        interpolations = std::move(other.interpolations);
+        dependents = std::move(other.dependents);
+        environment = std::move(other.environment);
+        templateLibrary = std::move(other.templateLibrary);
+        includes = std::move(other.includes);
+        references = std::move(other.references);
+        lineRuns = std::move(other.lineRuns);
+        templateOffsets = std::move(other.templateOffsets);
+        blocks = std::move(other.blocks);
+        blockSegments = std::move(other.blockSegments);
+        blockHeads = std::move(other.blockHeads);
+        pendingBlocks = std::exchange(other.pendingBlocks, 0);
+        prefixStack = std::move(other.prefixStack);
+        inputBuffer = std::move(other.inputBuffer);
+        valueBuffer = std::move(other.valueBuffer);
+        lineBuffer = std::move(other.lineBuffer);
+        keyBuffer = std::move(other.keyBuffer);
+        options = other.options;
+
+        return *this;
+    }
+
+    /** Use clone() to copy */
+    Properties(const Properties&) = delete;
+    Properties& operator=(const Properties&) = delete;
+
+    /**
+     * Create a copy in constant time. Keys, values and lines are shared with
+     * this instance and copied on write: the first update or removal of a
+     * property in either instance copies only the chunk of the property table
+     * holding it. Adding new keys copies the key pool, and adding comments or
+     * parsing copies the line text.
+     *
+     * Clones use the same memory resource, which must outlive all of them. Each
+     * clone can be used from its own thread, as shared storage is copied rather
+     * than updated while another clone refers to it.
+     *
+     * @return A copy of the properties
+     */
+    inline Properties clone() const
+    {
+        materializeAll();
+
+        Properties copy(options, resource());
+        copy.keyPool = keyPool;
+        copy.props = props;
+        copy.filter = filter;
+        copy.count = count;
+        copy.lines = lines;
+        copy.lineText = lineText;
+        copy.environment = environment;
+        copy.templateLibrary = templateLibrary;
+
+        return copy;
+    }
+
+    /**
+     * @return The memory resource used for all storage
+     */
+    inline std::pmr::memory_resource* resource() const
+    {
+        return props.resource();
+    }
+
+    /**
+     * Parse the input stream. Relative paths of include directives are resolved
+     * against the working directory.
+     *
+     * @param stream Input stream, such as a std::ifstream
+     */
+    inline void parse(std::istream& stream)
+    {
+        parse(stream, std::filesystem::path());
+    }
+
+    /**
+     * Parse the input stream, such as a file opened by the caller
+     *
+     * @param stream Input stream, such as a std::ifstream
+     * @param baseDir Directory relative paths of include directives are resolved
+     *        against, usually the directory of the file. If empty, the working
+     *        directory is used.
+     */
+    inline void parse(std::istream& stream, const std::filesystem::path& baseDir)
+    {
+        // Blocks deferred by an earlier parse are part of the properties, but their text is about to be replaced
+        materializeAll();
+
+        // Resolve template variables and includes
+        inputBuffer.clear();
+        includes.clear();
+        references.clear();
+        templateOffsets.clear();
+        lineRuns.clear();
+        preprocess(stream, inputBuffer, &includes, &references, storesLines() ? &lineRuns : nullptr, baseDir);
+
+        // Any resolution or interpolation may change as properties are added
+        resolutions.clear();
+        clearInterpolations();
+        clearBlocks();
+
+        parseLines(inputBuffer);
+
+        // Interned values are only shared between properties from here on
+        valuePool.clear();
+    }
+
+    /**
+     * Use a template library for template variables which the parsed file doesn't
+     * define itself. The library takes effect with the next parse(...), and in
+     * lazy mode must not be replaced while blocks are left to parse.
+     *
+     * Properties instantiated from a library template share its values and
+     * formatting, rather than allocating their own from the memory resource,
+     * until they're updated.
+     *
+     * @param library Template library, which may be shared with other instances
+     */
+    inline void setTemplates(std::shared_ptr<const TemplateLibrary> library)
+    {
+        templateLibrary = std::move(library);
+    }
+
+    /**
+     * @return The template library, or nullptr if none is used
+     */
+    inline const std::shared_ptr<const TemplateLibrary>& templates() const
+    {
+        return templateLibrary;
+    }
+
+    /**
+     * Remove all properties and lines. Allocated capacity is kept, so the
+     * instance can be reused for parsing without reallocating its tables.
+     */
+    inline void reset()
+    {
+        if (keyPool.shared())
+            keyPool = detail::CowPtr<detail::KeyPool>(resource());
+        else
+            keyPool.own().clear();
+
+        props.clear();
+        count = 0;
+        clearFilter();
+        lines.clear();
+        clearLineText();
+        resolveNames.clear();
+        nameGenerations.clear();
+        resolutions.clear();
+        clearInterpolations();
+        clearBlocks();
+        includes.clear();
+        references.clear();
+        prefixStack.clear();
+    }
+
+    /**
+     * Replace the contents with the properties parsed from the stream.
+     *
+     * Unlike reset() followed by parse(...), interned keys and unchanged values
+     * are reused along with all capacity, so reloading a similar file performs
+     * next to no allocations. Keys which are no longer present remain interned
+     * until reset() is called.
+     *
+     * @param stream Input stream, such as a std::ifstream
+     * @param baseDir Directory relative paths of include directives are resolved
+     *        against. If empty, the working directory is used.
+     */
+    inline void reparse(std::istream& stream, const std::filesystem::path& baseDir = std::filesystem::path())
+    {
+        // The contents are replaced, so blocks left to parse are dropped rather than parsed
+        clearBlocks();
+
+        // Keep the values so parse(...) can reuse them
+        for (std::size_t id = 0; id < props.size(); id++)
+        {
+            Prop& prop = props.mutate(id);
+            prop.present = false;
+            prop.modified = false;
+        }
+
+        count = 0;
+        clearFilter();
+        lines.clear();
+        clearLineText();
+        prefixStack.clear();
+
+        parse(stream, baseDir);
+
+        // Release values of properties which are gone
+        for (std::size_t id = 0; id < props.size(); id++)
+        {
+            if (!props[id].present && !props[id].value.empty())
+                props.mutate(id).value = detail::Value();
+        }
+    }
+
+    /**
+     * Expands template variables.
+     *
+     * @note This method could be merged with parse(...) so that even
+     *       template expansions are pretty printed
+     * @param is Input stream
+     * @return Stream with expanded variables
+     */
+    inline std::stringstream preprocess(std::istream& is)
+    {
+        std::pmr::string expanded(resource());
+        preprocess(is, expanded);
+
+        std::stringstream os;
+        os.write(expanded.data(), expanded.size());
+
+        return os;
+    }
+
+    /**
+     * Drop all included files cached by the process. Cached files are otherwise
+     * kept, and reused while their time stamp, size or content is unchanged.
+     */
+    static inline void clearIncludeCache()
+    {
+        std::lock_guard<std::mutex> lock(includeMutex());
+        includeCache().clear();
+    }
+
+    /**
+     * If a key occurs inside a prefix block, prepend the prefix.
+     *
+     * @param key Key to prepend (original is not changed)
+     * @return Key with prefix, or the original if no prefix is currently active
+     */
+    std::string prependPrefix(const std::string& key)
+    {
+        if (!prefixStack.empty())
+            return keyPool->str(prefixStack.back()) + "." + key;
+        else
+            return key;
+    }
+
+    /**
+     * @return true if the key exists
+     */
+    bool hasKey(std::string_view key) const
+    {
+        std::uint64_t h = detail::hash(key);
+        return environment->find(key, h) || findId(key, h) != detail::NoKey;
+    }
+
+    /**
+     * @return true if the key with the parts joined by dots exists
+     */
+    bool hasKey(std::initializer_list<std::string_view> parts) const
+    {
+        std::string_view value;
+        return findValue(parts.begin(), parts.size(), value);
+    }
+
+    /**
+     * Look up a batch of keys. All keys are hashed first and the memory their
+     * lookups will touch is prefetched, so the cache misses of the batch overlap
+     * instead of being paid one key at a time. This pays off for large tables.
+     *
+     * The values are views which remain valid until the properties are modified,
+     * parsed or cleared.
+     *
+     * @param keys Keys to look up
+     * @param count Number of keys
+     * @param values Receives count values: the value of each key, or nullopt if it doesn't exist
+     */
+    inline void getMany(const std::string_view* keys, std::size_t count, std::optional<std::string_view>* values) const
+    {
+        // Parse any deferred blocks up front, so no view is invalidated by parsing later in the batch
+        if (pendingBlocks > 0)
+        {
+            for (std::size_t index = 0; index < count; index++)
+                materialize(keys[index]);
+        }
+
+        if (environment->size() > 0)
+        {
+            for (std::size_t index = 0; index < count; index++)
+            {
+                std::string_view value;
+                values[index] = findValue(keys[index], value) ? std::optional<std::string_view>(value) : std::nullopt;
+            }
+
+            return;
+        }
+
+        // Batches are bounded so the hashes stay on the stack
+        constexpr std::size_t BatchSize = 32;
+        std::uint64_t hashes[BatchSize];
+
+        for (std::size_t start = 0; start < count; start += BatchSize)
+        {
+            std::size_t size = std::min(BatchSize, count - start);
+            const std::string_view* batch = keys + start;
+
+            for (std::size_t index = 0; index < size; index++)
+            {
+                hashes[index] = detail::hash(batch[index]);
+                filter->prefetch(hashes[index]);
+            }
+
+            // Bit i is set if key i passed the filter
+            std::uint32_t candidates = 0;
+            for (std::size_t index = 0; index < size; index++)
+            {
+                if (filter->mayContain(hashes[index]))
+                {
+                    keyPool->prefetch(hashes[index]);
+                    candidates |= std::uint32_t(1) << index;
+                }
+            }
+
+            for (std::size_t index = 0; index < size; index++)
+            {
+                std::optional<std::string_view>& value = values[start + index];
+                value.reset();
+
+                if (!(candidates & (std::uint32_t(1) << index)))
+                    continue;
+
+                detail::KeyId id = keyPool->lookup(batch[index], hashes[index]);
+                if (findProp(id))
+                    value = valueOf(id);
+            }
+        }
+    }
+
+    /**
+     * Look up a batch of keys, as getMany(keys, count, values) does
+     *
+     * @return The value of each key, or nullopt if it doesn't exist
+     */
+    inline std::vector<std::optional<std::string_view>> getMany(std::initializer_list<std::string_view> keys) const
+    {
+        std::vector<std::optional<std::string_view>> values(keys.size());
+        getMany(keys.begin(), keys.size(), values.data());
+
+        return values;
+    }
+
+    /**
+     * Get a property value. The returned value will be trimmed.
+     *
+     * Updating the value will preserve whitespaces.
+     *
+     * @param key Property key
+     * @return Property value, or an empty string if the key doesn't exists.
+     */
+    inline std::string get(std::string_view key) const
+    {
+        std::string res = "";
+        findValue(key, res);
+
+        return res;
+    }
+
+    inline std::string get(std::string_view key, std::string_view defaultValue) const
+    {
+        std::string_view res = defaultValue;
+        findValue(key, res);
+
+        return std::string(res);
+    }
+
+    /**
+     * Get a property by the parts of its key, such as {"server", tenant, "level"}.
+     * The parts are hashed and compared to the stored key one by one, so they're
+     * never joined into a string.
+     *
+     * @param parts Parts of the key, which are joined by dots
+     * @return Property value, or an empty string if the key doesn't exists.
+     */
+    inline std::string get(std::initializer_list<std::string_view> parts) const
+    {
+        std::string_view res;
+        findValue(parts.begin(), parts.size(), res);
+
+        return std::string(res);
+    }
+
+    inline std::string get(std::initializer_list<std::string_view> parts, std::string_view defaultValue) const
+    {
+        std::string_view res = defaultValue;
+        findValue(parts.begin(), parts.size(), res);
+
+        return std::string(res);
+    }
+
+    /**
+     * Returns true if the value is "true", "1" or "yes"
+     *
+     * @param key Property key
+     * @param defaultValue Default value if the key doesn't exist
+     * @return Property value, or an empty string if the key doesn't exists.
+     */
+    inline bool getBool(std::string_view key, bool defaultValue)
+    {
+        std::string_view val;
+        if (findValue(key, val))
+        {
+            return (val == "true" || val == "1" || val == "yes");
+        }
+        else
+            return defaultValue;
+    }
+
+    /**
+     * A view of the properties under a prefix, returned by group(...). Keys are
+     * looked up relative to the prefix without building the full key: the hash
+     * of the prefix is computed once and continued with the relative key, which
+     * is compared against the interned segments below the prefix.
+     *
+     * A group refers to the properties it was created from, which must outlive it,
+     * and is invalidated by reset().
+     */
+    class Group
+    {
+    public:
+
+        /**
+         * @return Property value, or an empty string if the key doesn't exist
+         */
+        inline std::string get(std::string_view key) const
+        {
+            std::string_view value;
+            findValue(key, value);
+
+            return std::string(value);
+        }
+
+        inline std::string get(std::string_view key, std::string_view defaultValue) const
+        {
+            std::string_view value = defaultValue;
+            findValue(key, value);
+
+            return std::string(value);
+        }
+
+        /**
+         * Returns true if the value is "true", "1" or "yes"
+         */
+        inline bool getBool(std::string_view key, bool defaultValue) const
+        {
+            std::string_view value;
+            if (!findValue(key, value))
+                return defaultValue;
+
+            return value == "true" || value == "1" || value == "yes";
+        }
+
+        /**
+         * @return true if the key exists
+         */
+        inline bool hasKey(std::string_view key) const
+        {
+            std::string_view value;
+            return findValue(key, value);
+        }
+
+        /**
+         * @return A view of the properties under a prefix relative to this group,
+         *         or this group if the prefix is empty
+         */
+        inline Group group(std::string_view prefix) const
+        {
+            if (prefix.empty())
+                return *this;
+
+            if (groupPrefix.empty())
+                return owner->group(prefix);
+
+            std::string full;
+            full.reserve(groupPrefix.size() + 1 + prefix.size());
+            full.append(groupPrefix).append(1, '.').append(prefix);
+
+            return Group(owner, std::move(full), detail::hash(prefix, dotHash));
+        }
+
+        /**
+         * @return The prefix of the group
+         */
+        inline const std::string& prefix() const
+        {
+            return groupPrefix;
+        }
+
+    private:
+
+        Group(const Properties* owner, std::string prefix, std::uint64_t prefixHash)
+            : owner(owner), groupPrefix(std::move(prefix)), dotHash(detail::hash(".", prefixHash)),
+              prefixId(owner->keyPool->lookup(groupPrefix, prefixHash))
+        {}
+
+        /**
+         * Find the value of a key relative to the prefix, as Properties::findValue(...) does
+         */
+        inline bool findValue(std::string_view key, std::string_view& value) const
+        {
+            // The group of the empty prefix holds all properties
+            if (groupPrefix.empty())
+                return owner->findValue(key, value);
+
+            // Environment overrides and blocks left to parse are found by the full key
+            if (owner->environment->size() > 0 || owner->pendingBlocks > 0)
+            {
+                std::string full;
+                full.reserve(groupPrefix.size() + 1 + key.size());
+                full.append(groupPrefix).append(1, '.').append(key);
+
+                return owner->findValue(full, value);
+            }
+
+            // The prefix may have been added since the group was created
+            detail::KeyId ancestor = prefixId;
+            if (ancestor == detail::NoKey)
+                ancestor = owner->keyPool->find(groupPrefix);
+
+            if (ancestor == detail::NoKey)
+                return false;
+
+            std::uint64_t h = detail::hash(key, dotHash);
+            if (!owner->filter->mayContain(h))
+                return false;
+
+            detail::KeyId id = owner->keyPool->lookup(key, h, ancestor);
+            if (!owner->findProp(id))
+                return false;
+
+            value = owner->valueOf(id);
+            return true;
+        }
+
+        const Properties* owner;
+        std::string groupPrefix;
+
+        /** Hash of the prefix followed by a dot, which keys of the group continue */
+        std::uint64_t dotHash;
+
+        /** The prefix, or NoKey if it wasn't interned when the group was created */
+        detail::KeyId prefixId;
+
+        friend class Properties;
+    };
+
+    /**
+     * Get a view of the properties under a prefix, for code handling a subsystem
+     *
+     *     auto database = props.group("backend.database");
+     *     std::string host = database.get("host");
+     *     std::string level = database.group("log").get("level");
+     *
+     * @param prefix Dotted prefix. If empty, the group holds all properties.
+     * @return View of the keys under the prefix
+     */
+    inline Group group(std::string_view prefix) const
+    {
+        return Group(this, std::string(prefix), detail::hash(prefix));
+    }
+
+    /**
+     * Get the most specific value of a name within a scope, falling back to
+     * enclosing scopes. Resolving "log.level" in scope "server.alternative"
+     * returns the first existing of
+     *
+     *      server.alternative.log.level
+     *      server.log.level
+     *      log.level
+     *
+     * This mirrors the nesting of prefix blocks. Results are memoized and only
+     * recomputed after a property whose key ends with the name is added or
+     * removed, so repeated resolution costs about the same as get(...). As the
+     * cache is updated, resolve(...) must not be called concurrently on the same
+     * instance. Environment overrides are consulted for every candidate key, as
+     * get(...) would, in which case results aren't memoized.
+     *
+     * @param scope Dotted scope, which may be empty
+     * @param name Dotted name to find within the scope
+     * @return Property value, or an empty string if no scope has the name
+     */
+    inline std::string resolve(std::string_view scope, std::string_view name)
+    {
+        if (environment->size() > 0)
+            return resolveOverridden(scope, name);
+
+        detail::KeyId id = resolveKey(scope, name);
+        return id != detail::NoKey ? std::string(valueOf(id)) : std::string();
+    }
+
+    /**
+     * Resolve a key whose last segment is the name and the rest is the scope.
+     * "server.alternative.level" falls back to "server.level", then "level".
+     */
+    inline std::string resolve(std::string_view key)
+    {
+        std::string_view::size_type dot = key.rfind('.');
+        if (dot == std::string_view::npos)
+            return resolve(std::string_view(), key);
+
+        return resolve(key.substr(0, dot), key.substr(dot + 1));
+    }
+
+    /**
+     * Overlay the properties with environment variables, such as overrides
+     * injected into a container. The environment is read once, mapping each
+     * variable through the naming transform: with prefix "MYAPP_", the variable
+     * MYAPP_SERVER_HOST overrides "server.host". Variables without the prefix
+     * are ignored.
+     *
+     * Overrides take precedence in get(...), getBool(...), hasKey(...), resolve(...)
+     * and in interpolated references. They aren't part of the properties, so
+     * text(), entries() and keys() are unaffected. Loading again replaces the
+     * overlay.
+     *
+     * @param prefix Prefix of the variables to use. It must not be empty, as every
+     *        variable, such as PATH, would then override a property. Use a custom
+     *        transform to map variables without a prefix.
+     * @throws std::invalid_argument if the prefix is empty
+     */
+    inline void loadEnvironment(std::string_view prefix)
+    {
+        if (prefix.empty())
+            throw std::invalid_argument("Environment variable prefix must not be empty");
+
+        loadEnvironment([prefix](std::string_view name, std::string& key) { return environmentKey(name, prefix, key); });
+    }
+
+    /**
+     * Overlay the properties with environment variables mapped by a custom transform
+     *
+     * @param transform Called as bool(std::string_view name, std::string& key) for each
+     *        variable. Sets the property key and returns true, or returns false to skip
+     *        the variable.
+     */
+    template <typename Transform,
+              typename = std::enable_if_t<std::is_invocable_r_v<bool, Transform&, std::string_view, std::string&>>>
+    inline void loadEnvironment(Transform transform)
+    {
+        if (environment.shared())
+            environment = detail::CowPtr<detail::StringMap>(resource());
+
+        detail::StringMap& env = environment.own();
+        env.clear();
+
+        std::string key;
+        for (char** var = detail::environment(); var && *var; var++)
+        {
+            std::string_view entry(*var);
+            std::string_view::size_type assignPos = entry.find('=');
+            if (assignPos == std::string_view::npos)
+                continue;
+
+            key.clear();
+            if (transform(entry.substr(0, assignPos), key))
+                env.set(key, entry.substr(assignPos + 1));
+        }
+
+        // Expansions may refer to overridden keys
+        clearInterpolations();
+    }
+
+    /**
+     * The default environment naming transform. The prefix is removed, letters are
+     * lowercased and underscores become dots.
+     *
+     * @return false if the name lacks the prefix
+     */
+    static inline bool environmentKey(std::string_view name, std::string_view prefix, std::string& key)
+    {
+        if (name.size() <= prefix.size() || name.substr(0, prefix.size()) != prefix)
+            return false;
+
+        for (char ch : name.substr(prefix.size()))
+            key.push_back(ch == '_' ? '.' : static_cast<char>(std::tolower(static_cast<unsigned char>(ch))));
+
+        return true;
+    }
+
+    /**
+     * Update the property value. If the key already exists, attempt to
+     * maintain as much whitespace information as possible (this work is only
+     * done if text() is called; this method simply updates the property value)
+     *
+     * @param key Property key
+     * @param value New property value
+     * @return The old key, if any
+     */
+    inline std::string put(std::string_view key, std::string_view value)
+    {
+        Prop& prop = update(key);
+
+        std::string old(prop.value.view());
+        prop.value = detail::Value(value, resource());
+
+        return old;
+    }
+
+    /**
+     * Like put(...), but without returning the old value. Storing the value is
+     * the only allocation, unless the key is new to the instance.
+     *
+     * @param key Property key
+     * @param value New property value
+     */
+    inline void set(std::string_view key, std::string_view value)
+    {
+        update(key).value = detail::Value(value, resource());
+    }
+
+    /**
+     * Make room for a number of additional properties
+     */
+    inline void reserve(std::size_t count)
+    {
+        // A shared key pool is copied when the first new key is added
+        if (!keyPool.shared())
+            keyPool.own().reserve(count);
+
+        props.reserve(props.size() + count);
+
+        if (filter->capacity() < this->count + count)
+            rebuildFilter(this->count + count);
+
+        if (storesLines())
+            lines.reserve(lines.size() + count);
+    }
+
+    /**
+     * Put all key/value pairs in a range, such as a std::map or a vector of
+     * pairs. Room for the properties is reserved up front when the size of
+     * the range is known.
+     *
+     * @param first Start of the range; elements must have first and second members
+     * @param last End of the range
+     */
+    template <typename Iterator>
+    inline void putAll(Iterator first, Iterator last)
+    {
+        using Category = typename std::iterator_traits<Iterator>::iterator_category;
+        if constexpr (std::is_base_of<std::forward_iterator_tag, Category>::value)
+            reserve(static_cast<std::size_t>(std::distance(first, last)));
+
+        for (; first != last; ++first)
+            set(first->first, first->second);
+    }
+
+    template <typename Range>
+    inline void putAll(const Range& range)
+    {
+        putAll(std::begin(range), std::end(range));
+    }
+
+    /**
+     * @return Properties created from the key/value pairs in a range; see putAll(...)
+     */
+    template <typename Iterator>
+    static inline Properties fromRange(Iterator first, Iterator last, const Options& options = Options(),
+                                       std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+    {
+        Properties props(options, resource);
+        props.putAll(first, last);
+
+        return props;
+    }
+
+    /**
+     * Remove a property if it exists.
+     *
+     * @param key Property key
+     */
+    inline void remove(std::string_view key)
+    {
+        materialize(key);
+
+        detail::KeyId id = keyPool->find(key);
+        if (id != detail::NoKey && id < props.size() && props[id].present)
+        {
+            invalidateInterpolation(id);
+            props.mutate(id) = Prop();
+            count--;
+            invalidateResolutions(key);
+
+            // Removed keys stay in the filter until it's rebuilt
+            filter.own().erase();
+            if (filter->stale() > count)
+                rebuildFilter(count * 2);
+        }
+    }
+
+    /**
+     * Append an empty line. Ignored in read-only mode.
+     */
+    inline void putEmptyLine()
+    {
+        if (!storesLines())
+            return;
+
+        addLine(LineType::Empty);
+    }
+
+    /**
+     * Append a comment. Ignored in read-only mode.
+     *
+     * @param comment Comment. If the leading # or ! is missing, it will be added
+     */
+    inline void putComment(std::string_view comment)
+    {
+        if (!storesLines())
+            return;
+
+        std::string_view line = trim(comment);
+
+        if (!line.empty())
+        {
+            Line& entry = addLine(LineType::Comment);
+            std::pmr::string& text = lineText.own();
+
+            if (line[0] != '#' && line[0] != '!')
+                text.append("# ");
+
+            text.append(line);
+            entry.length = static_cast<std::uint32_t>(text.size() - entry.offset);
+        }
+    }
+
+    /**
+     * Iterates over properties without copying keys or values. Dereferencing
+     * yields a pair of string views (key, value), so structured bindings work:
+     *
+     *      for (auto [key, value] : props.entries())
+     *
+     * The key is assembled in a buffer owned by the iterator, so it is only
+     * valid until the iterator is advanced. Copies have their own buffer.
+     * Values are valid until the property is updated or removed.
+     */
+    class EntryIterator
+    {
+    public:
+
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::pair<std::string_view, std::string_view>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const value_type*;
+        using reference = const value_type&;
+
+        EntryIterator(const Properties* owner, std::size_t pos, bool fileOrder)
+            : owner(owner), pos(pos), fileOrder(fileOrder)
+        {
+            settle();
+        }
+
+        // The entry refers to the key buffer, so copies must refer to their own buffer
+
+        EntryIterator(const EntryIterator& other)
+            : owner(other.owner), pos(other.pos), fileOrder(other.fileOrder), key(other.key), entry(key, other.entry.second)
+        {}
+
+        EntryIterator(EntryIterator&& other) noexcept
+            : owner(other.owner), pos(other.pos), fileOrder(other.fileOrder), key(std::move(other.key)), entry(key, other.entry.second)
+        {}
+
+        inline EntryIterator& operator=(const EntryIterator& other)
+        {
+            if (this != &other)
+            {
+                owner = other.owner;
+                pos = other.pos;
+                fileOrder = other.fileOrder;
+                key = other.key;
+                entry = value_type(key, other.entry.second);
+            }
+
+            return *this;
+        }
+
+        inline EntryIterator& operator=(EntryIterator&& other) noexcept
+        {
+            if (this != &other)
+            {
+                owner = other.owner;
+                pos = other.pos;
+                fileOrder = other.fileOrder;
+                key = std::move(other.key);
+                entry = value_type(key, other.entry.second);
+            }
+
+            return *this;
+        }
+
+        inline reference operator*() const
+        {
+            return entry;
+        }
+
+        inline pointer operator->() const
+        {
+            return &entry;
+        }
+
+        inline EntryIterator& operator++()
+        {
+            pos++;
+            settle();
+            return *this;
+        }
+
+        inline bool operator==(const EntryIterator& other) const
+        {
+            return pos == other.pos;
+        }
+
+        inline bool operator!=(const EntryIterator& other) const
+        {
+            return pos != other.pos;
+        }
+
+    private:
+
+        /**
+         * Move to the first property at or after pos
+         */
+        inline void settle()
+        {
+            std::size_t end = fileOrder ? owner->lines.size() : owner->props.size();
+
+            for (; pos < end; pos++)
+            {
+                detail::KeyId id = static_cast<detail::KeyId>(pos);
+
+                // In file order, a property is visited at the line defining it
+                if (fileOrder)
+                {
+                    const Line& line = owner->lines[pos];
+                    id = line.linetype == LineType::Property ? line.key : detail::NoKey;
+
+                    const Prop* prop = owner->findProp(id);
+                    if (!prop || prop->line != pos)
+                        continue;
+                }
+                else if (!owner->props[pos].present)
+                {
+                    continue;
+                }
+
+                key.clear();
+                owner->keyPool->append(key, id);
+                entry = value_type(key, owner->props[id].value.view());
+                return;
+            }
+        }
+
+        const Properties* owner;
+        std::size_t pos;
+        bool fileOrder;
+        std::string key;
+        value_type entry;
+    };
+
+    /** A range of entries; see EntryIterator */
+    class EntryRange
+    {
+    public:
+
+        EntryRange(const Properties* owner, bool fileOrder) : owner(owner), fileOrder(fileOrder)
+        {}
+
+        inline EntryIterator begin() const
+        {
+            return EntryIterator(owner, 0, fileOrder);
+        }
+
+        inline EntryIterator end() const
+        {
+            return EntryIterator(owner, fileOrder ? owner->lines.size() : owner->props.size(), fileOrder);
+        }
+
+    private:
+
+        const Properties* owner;
+        bool fileOrder;
+    };
+
+    /**
+     * @return All properties, in the order their keys were first added
+     */
+    inline EntryRange entries() const
+    {
+        materializeAll();
+        return EntryRange(this, false);
+    }
+
+    /**
+     * @return All properties in file order, with properties added by put(...)
+     *         last. Not available in read-only mode, where no lines are kept.
+     */
+    inline EntryRange fileEntries() const
+    {
+        if (!storesLines())
+            throw std::logic_error("fileEntries() is not available in read-only, lazy or filtered mode");
+
+        return EntryRange(this, true);
+    }
+
+    /**
+     * @return Number of properties
+     */
+    inline std::size_t size() const
+    {
+        materializeAll();
+        return count;
+    }
+
+    /**
+     * @return All keys
+     */
+    inline std::vector<std::string> keys()
+    {
+        materializeAll();
+
+        std::vector<std::string> res;
+        res.reserve(count);
+
+        for (detail::KeyId id = 0; id < props.size(); id++)
+        {
+            if (props[id].present)
+                res.emplace_back(keyPool->str(id));
+        }
+
+        return res;
+    }
+
+    /**
+     * @return All values
+     */
+    inline std::vector<std::string> values()
+    {
+        materializeAll();
+
+        std::vector<std::string> res;
+        res.reserve(count);
+
+        for (std::size_t id = 0; id < props.size(); id++)
+        {
+            if (props[id].present)
+                res.emplace_back(props[id].value.view());
+        }
+
+        return res;
+    }
+
+    /**
+     * Renders the properties as a string, including any updates. This can be
+     * written to the property file.
+     *
+     * The original property formatting is kept intact, unless prettyPrint is set.
+     *
+     * Pretty printing removes unnecessary white spaces, and multiple blank lines
+     * in a row are collapsed into a single blank line.
+     *
+     * Included files are rendered as their include directive. Properties of
+     * included files which have been updated are rendered before the directive,
+     * so they take precedence when the text is parsed again. Removals of included
+     * properties aren't rendered.
+     *
+     * @param prettyPrint If true, the output is pretty printed.
+     * @return Properties as text
+     * @throws std::logic_error if the properties were parsed in read-only mode
+     */
+    inline std::string text(bool prettyPrint=false)
+    {
+        if (!storesLines())
+            throw std::logic_error("text() is not available in read-only, lazy or filtered mode");
+
+        std::ostringstream ss;
+
+        const Line* prev = nullptr;
+        size_t idx = 0;
+        std::string bareKey;
+        int prefixDepth = 0;
+
+        for (std::size_t pos = 0; pos < lines.size(); pos++)
+        {
+            const Line& entry = lines[pos];
+
+            // Included files are rendered as their include directive
+            if (entry.included)
+                continue;
+
+            switch (entry.linetype)
+            {
+                case LineType::Empty:
+                {
+                    // A subtle point is that \r is implicitly preserved for \r\n line endings,
+                    // because \r occurs before \n
+                    if (!prettyPrint || !(prev && prev->linetype == LineType::Empty))
+                        ss << "\n";
+
+                    break;
+                }
+                case LineType::Comment:
+                case LineType::Include:
+                {
+                    std::string_view line(lineText->data() + entry.offset, entry.length);
+
+                    // Included files aren't rewritten, so updates of their properties precede the directive
+                    if (entry.linetype == LineType::Include)
+                    {
+                        std::string indent = prettyPrint ? std::string(prefixDepth*4, ' ')
+                            : std::string(line.substr(0, line.find_first_not_of(WS)));
+                        renderIncludedUpdates(ss, pos, indent);
+                    }
+
+                    ss << (prettyPrint ? trim(line) : line);
+                    ss << "\n";
+
+                    break;
+                }
+                case LineType::Property:
+                {
+                    // The property may have been removed
+                    const Prop* prop = findProp(entry.key);
+                    if (prop)
+                    {
+                        bareKey.clear();
+                        keyPool->append(bareKey, entry.key, entry.prefix);
+
+                        if (prettyPrint)
+                        {
+                            // Indent prefix blocks
+                            if (prefixDepth > 0)
+                                ss << std::string(prefixDepth*4, ' ');
+
+                            ss << bareKey;
+
+                            if (!prop->value.empty())
+                                ss << " = " << escape(prop->value.view());
+                        }
+                        else
+                        {
+                            // Inject whitespaces before and after key, value
+                            std::string_view format = entry.generated ? GeneratedFormat
+                                : std::string_view(lineText->data() + entry.offset, entry.length);
+                            ss << format.substr(0, entry.beforeKey) << bareKey
+                               << format.substr(entry.beforeKey, entry.afterKey);
+
+                            if (!entry.lacksAssignment || prop->modified)
+                            {
+                                format.remove_prefix(entry.beforeKey + entry.afterKey);
+                                ss << "=" << format.substr(0, entry.beforeValue) << escape(prop->value.view())
+                                   << format.substr(entry.beforeValue);
+                            }
+                        }
+
+                        ss << "\n";
+                    }
+
+                    break;
+                }
+                case LineType::BlockStart:
+                {
+                    ss << std::string(prefixDepth*4, ' ') << "{" << '\n';
+                    prefixDepth++;
+
+                    break;
+                }
+                case LineType::BlockEnd:
+                {
+                    prefixDepth--;
+                    ss << std::string(prefixDepth*4, ' ') << "}" << '\n';
+
+                    break;
+                }
+                default:
+                    break;
+            }
+
+            prev = &entry;
+            idx++;
+        }
+
+        return ss.str();
+    }
+
+private:
+
+    enum LineType
+    {
+        Property, Comment, Empty, MultilineValue,
+        BlockStart, BlockEnd,
+        TemplateStart, TemplateLine, TemplateEnd,
+        Include
+    };
+
+    /**
+     * Represents a line in the input, with enough information to preserve formatting.
+     *
+     * The text of a line is kept in lineText, so entries don't own any memory. Comments
+     * store the line exactly as it occurs in the file. Properties store the white spaces
+     * around the key and the value, back to back in that order.
+     */
+    struct Line
+    {
+        /** Type of line */
+        LineType linetype = LineType::Property;
+
+        /**
+         * The line may contain only a key and lack "=value"
+         * This fact must be recorded for doing unformatted output
+         */
+        bool lacksAssignment = false;
+
+        /** True if the line was added by updating a property; see GeneratedFormat */
+        bool generated = false;
+
+        /** True if the line is part of an included file */
+        bool included = false;
+
+        /** The key in this line, when type is LineType::Property. This may include a prefix. */
+        detail::KeyId key = detail::NoKey;
+
+        /** Prefix block of the key, if any. The key is rendered relative to it, as it appears in the file. */
+        detail::KeyId prefix = detail::NoKey;
+
+        /** Position of the text in lineText */
+        std::size_t offset = 0;
+        std::uint32_t length = 0;
+
+        /* Format preservation; lengths of the white spaces stored for a property */
+
+        std::uint32_t beforeKey = 0;
+        std::uint32_t afterKey = 0;
+        std::uint32_t beforeValue = 0;
+        std::uint32_t afterValue = 0;
+
+        /**
+         * Line number in the parsed stream, or 0 for lines not parsed. Lines of included
+         * files and expanded templates have the number of the directive or template variable.
+         */
+        std::uint32_t number = 0;
+    };
+
+    /**
+     * Append a line entry
+     *
+     * @param linetype Type of line
+     * @param text Text to keep for the line, if any
+     * @return The new entry
+     */
+    inline Line& addLine(LineType linetype, std::string_view text = {})
+    {
+        Line& entry = lines.emplace_back();
+        entry.linetype = linetype;
+        entry.included = including;
+        entry.number = currentLine;
+        entry.offset = lineText->size();
+        entry.length = static_cast<std::uint32_t>(text.size());
+
+        if (!text.empty())
+            lineText.own().append(text);
+
+        return entry;
+    }
+
+    /**
+     * Record the white spaces around the key and value of a property line
+     */
+    inline void setFormat(Line& entry, std::string_view beforeKey, std::string_view afterKey,
+                          std::string_view beforeValue, std::string_view afterValue)
+    {
+        entry.offset = lineText->size();
+        entry.beforeKey = static_cast<std::uint32_t>(beforeKey.size());
+        entry.afterKey = static_cast<std::uint32_t>(afterKey.size());
+        entry.beforeValue = static_cast<std::uint32_t>(beforeValue.size());
+        entry.afterValue = static_cast<std::uint32_t>(afterValue.size());
+        entry.length = entry.beforeKey + entry.afterKey + entry.beforeValue + entry.afterValue;
+
+        lineText.own().append(beforeKey).append(afterKey).append(beforeValue).append(afterValue);
+    }
+
+    /** Prefix state of parseLines(...), carried from line to line */
+    struct ParseState
+    {
+        /** Key of the last property line if it lacks an assignment, which prefixes a following block */
+        detail::KeyId prefix = detail::NoKey;
+
+        /** The prefix as written, and whether it was written at the top level of inputBuffer */
+        std::string_view prefixKey;
+        bool topLevelPrefix = false;
+
+        /** True if include or exclude prefixes are set */
+        bool filtered = false;
+
+        /**
+         * Set if the last property line lacks an assignment and is filtered out, so
+         * a block following it is skipped
+         */
+        bool skipNextBlock = false;
+
+        /** Index in lineRuns, and the position and number of the last line numbered */
+        std::size_t run = 0;
+        std::size_t numbered = 0;
+        std::uint32_t number = 0;
+    };
+
+    /** A lexed property line */
+    struct PropertyLine
+    {
+        /** The key as written */
+        std::string_view key;
+
+        /* White spaces around the key and the value; used when a part is missing or all white space */
+
+        std::string_view beforeKey = "";
+        std::string_view afterKey = " ";
+        std::string_view beforeValue = " ";
+        std::string_view afterValue = "";
+
+        /** Lines without = are considered keys with empty values. They may also start a prefix block. */
+        bool lacksAssignment = false;
+
+        /** Number of continuation lines of the value */
+        std::uint32_t continuations = 0;
+
+        /** For a line of a library template, its shared value and the position of its white spaces in lineText */
+        const detail::Value* value = nullptr;
+        std::size_t format = 0;
+    };
+
+    /**
+     * Refer to the white spaces of a library template line, which are already in lineText
+     */
+    inline void shareFormat(Line& entry, const PropertyLine& property)
+    {
+        entry.offset = property.format;
+        entry.beforeKey = static_cast<std::uint32_t>(property.beforeKey.size());
+        entry.afterKey = static_cast<std::uint32_t>(property.afterKey.size());
+        entry.beforeValue = static_cast<std::uint32_t>(property.beforeValue.size());
+        entry.afterValue = static_cast<std::uint32_t>(property.afterValue.size());
+        entry.length = entry.beforeKey + entry.afterKey + entry.beforeValue + entry.afterValue;
+    }
+
+    /**
+     * Store the text of a library template in lineText, once per parse
+     *
+     * @return Position of the text in lineText
+     */
+    inline std::size_t templateText(const TemplateLibrary::Template& referenced)
+    {
+        auto it = templateOffsets.find(&referenced);
+        if (it != templateOffsets.end())
+            return it->second;
+
+        std::size_t base = lineText->size();
+        lineText.own().append(referenced.text);
+        templateOffsets.emplace(&referenced, base);
+
+        return base;
+    }
+
+    /**
+     * Parse lines of the input buffer, starting with the current prefix stack
+     *
+     * @param is Lines to parse, which must be part of inputBuffer
+     */
+    inline void parseLines(std::string_view is)
+    {
+        std::string_view line;
+        std::pmr::string& value = valueBuffer;
+
+        ParseState state;
+        state.filtered = !options.include.empty() || !options.exclude.empty();
+        if (!lineRuns.empty())
+        {
+            state.numbered = lineRuns.front().offset;
+            state.number = lineRuns.front().number;
+        }
+
+        // End of the content of the current include directive
+        std::size_t includeEnd = 0;
+
+        while (nextLine(is, line))
+        {
+            std::size_t offset = static_cast<std::size_t>(line.data() - inputBuffer.data());
+            including = offset < includeEnd;
+            currentLine = lineNumber(offset, state);
+
+            if (isComment(line))
+            {
+                if (storesLines())
+                    addLine(LineType::Comment, line);
+            }
+            else if (isEmptyLine(line))
+            {
+                if (storesLines())
+                    addLine(LineType::Empty);
+            }
+            else if (isInclude(line))
+            {
+                // The content of the file follows the directive, and is rendered by text() as the directive
+                if (storesLines())
+                    addLine(LineType::Include, line).prefix = prefixStack.empty() ? detail::NoKey : prefixStack.back();
+
+                auto range = std::lower_bound(includes.begin(), includes.end(), offset,
+                                              [](const IncludeRange& r, std::size_t pos) { return r.offset < pos; });
+                if (range != includes.end() && range->offset == offset)
+                {
+                    includeEnd = range->end;
+
+                    if (range->lexed)
+                    {
+                        including = true;
+                        spliceTemplate(*range->lexed, offset, state);
+
+                        std::size_t position = static_cast<std::size_t>(is.data() - inputBuffer.data());
+                        is.remove_prefix(std::min(is.size(), includeEnd - position));
+                    }
+                }
+            }
+            else if (const TemplateLibrary::Template* referenced = referencedTemplate(line))
+            {
+                spliceTemplate(*referenced, offset, state);
+            }
+            else if (isBlockStart(line))
+            {
+                if (state.skipNextBlock)
+                {
+                    state.skipNextBlock = skipBlock(is);
+                    continue;
+                }
+
+                // In lazy mode, top level blocks are parsed on first access
+                if (options.lazy && prefixStack.empty() && state.prefix != detail::NoKey && state.topLevelPrefix)
+                {
+                    std::string_view block = is;
+                    if (!skipBlock(is))
+                    {
+                        deferBlock(state.prefix, state.prefixKey, block.substr(0, block.size() - is.size()));
+
+                        // The last property in the block has a value, so it prefixes nothing
+                        state.prefix = detail::NoKey;
+                        state.prefixKey = {};
+                        state.topLevelPrefix = false;
+                        state.skipNextBlock = false;
+                        continue;
+                    }
+
+                    // The last key in the block prefixes a following block, so parse it now
+                    is = block;
+                }
+
+                if (storesLines())
+                    addLine(LineType::BlockStart);
+
+                if (state.prefix != detail::NoKey)
+                    prefixStack.push_back(state.prefix);
+            }
+            else if (isBlockEnd(line))
+            {
+                if (storesLines())
+                    addLine(LineType::BlockEnd);
+
+                if (!prefixStack.empty())
+                    prefixStack.pop_back();
+            }
+            else
+            {
+                PropertyLine property;
+                std::string_view::size_type assignPos = lexKey(line, property);
+                detail::KeyId parent = prefixStack.empty() ? detail::NoKey : prefixStack.back();
+
+                if (!admit(property.key, property.lacksAssignment, parent, state))
+                {
+                    skipContinuation(is, line);
+                    continue;
+                }
+
+                if (property.lacksAssignment)
+                    value.clear();
+                else
+                    unescape(trim(line.substr(assignPos + 1), property.beforeValue, property.afterValue), value);
+
+                property.continuations = joinValue(is, value);
+                addProperty(property, parent, value, offset, state);
+            }
+        }
+
+        including = false;
+        currentLine = 0;
+    }
+
+    /**
+     * Number a line of inputBuffer. Lines must be numbered in order of position.
+     *
+     * @return Line number, or 0 if lines aren't numbered
+     */
+    inline std::uint32_t lineNumber(std::size_t offset, ParseState& state)
+    {
+        if (lineRuns.empty())
+            return 0;
+
+        while (state.run + 1 < lineRuns.size() && lineRuns[state.run + 1].offset <= offset)
+        {
+            state.run++;
+            state.numbered = lineRuns[state.run].offset;
+            state.number = lineRuns[state.run].number;
+        }
+
+        if (lineRuns[state.run].consecutive)
+        {
+            state.number += static_cast<std::uint32_t>(std::count(inputBuffer.data() + state.numbered,
+                                                                  inputBuffer.data() + offset, '\n'));
+            state.numbered = offset;
+        }
+
+        return state.number;
+    }
+
+    /**
+     * Lex the key of a property line
+     *
+     * @param line The line
+     * @param property Receives the key, the white spaces around it, and whether the line lacks an assignment
+     * @return Position of the =, or npos
+     */
+    inline std::string_view::size_type lexKey(std::string_view line, PropertyLine& property)
+    {
+        std::string_view::size_type assignPos = line.find_first_of("=");
+
+        property.key = trim(line.substr(0, assignPos), property.beforeKey, property.afterKey);
+        property.lacksAssignment = assignPos == std::string_view::npos;
+
+        return assignPos;
+    }
+
+    /**
+     * Finish decoding a value by unquoting it, and appending any continuation lines
+     *
+     * @param is Input following the property line, which continuation lines are removed from
+     * @param value The unescaped value of the property line, which receives the decoded value
+     * @return Number of continuation lines
+     */
+    inline std::uint32_t joinValue(std::string_view& is, std::pmr::string& value)
+    {
+        std::uint32_t continuations = 0;
+
+        if (isMultiLine(value))
+        {
+            // Remove the backslash
+            value.pop_back();
+
+            // Trim at the end and unquote
+            assignPart(value, unquote(trimright(value)));
+
+            std::string_view line;
+            while (nextLine(is, line))
+            {
+                continuations++;
+
+                std::string_view theline = trim(line);
+                if (isMultiLine(theline))
+                {
+                    theline.remove_suffix(1);
+                    if (endswith(theline, '"') || endswith(theline, '\\'))
+                    {
+                        theline = unquote(trimright(theline));
+                    }
+
+                    value.append(theline);
+                }
+                else
+                {
+                    value.append(unquote(theline));
+                    break;
+                }
+            }
+        }
+        else
+        {
+            assignPart(value, unquote(value));
+        }
+
+        return continuations;
+    }
+
+    /**
+     * Apply the include and exclude prefixes to a property line
+     *
+     * @param key Key as written on the line
+     * @param lacksAssignment True if the line may prefix a block
+     * @param parent Prefix of the enclosing block, or NoKey
+     * @return false if the key is filtered out, in which case only the prefix state is updated
+     */
+    inline bool admit(std::string_view key, bool lacksAssignment, detail::KeyId parent, ParseState& state)
+    {
+        state.skipNextBlock = false;
+        if (!state.filtered)
+            return true;
+
+        Selection selection = select(key, parent);
+        if (selection == Selection::Selected)
+            return true;
+
+        // A skipped key may still prefix a block holding wanted keys
+        state.prefix = detail::NoKey;
+        state.prefixKey = key;
+        state.topLevelPrefix = parent == detail::NoKey;
+        if (lacksAssignment && selection == Selection::Ancestor)
+            state.prefix = intern(key, parent);
+        else
+            state.skipNextBlock = lacksAssignment;
+
+        return false;
+    }
+
+    /**
+     * Store a parsed property line
+     *
+     * @param property The lexed line
+     * @param parent Prefix of the enclosing block, or NoKey
+     * @param value Decoded value
+     * @param offset Position of the line in inputBuffer
+     */
+    inline void addProperty(const PropertyLine& property, detail::KeyId parent, std::string_view value,
+                            std::size_t offset, ParseState& state)
+    {
+        detail::KeyId id = intern(property.key, parent);
+
+        // A key without a value may start a prefix block
+        state.prefix = property.lacksAssignment ? id : detail::NoKey;
+        state.prefixKey = property.key;
+        state.topLevelPrefix = parent == detail::NoKey;
+
+        // To avoid having to reparse the line, associate the key of a line with the Line entry
+        std::uint32_t lineIndex = NoLine;
+        if (storesLines())
+        {
+            lineIndex = static_cast<std::uint32_t>(lines.size());
+            Line& lineEntry = addLine(LineType::Property);
+            lineEntry.key = id;
+            lineEntry.prefix = parent;
+            lineEntry.lacksAssignment = property.lacksAssignment;
+            if (property.value)
+                shareFormat(lineEntry, property);
+            else
+                setFormat(lineEntry, property.beforeKey, property.afterKey, property.beforeValue, property.afterValue);
+
+            for (std::uint32_t continuation = 0; continuation < property.continuations; continuation++)
+                addLine(LineType::MultilineValue);
+        }
+        else if (options.lazy)
+        {
+            // Blocks are parsed out of order, so the position in the input decides which occurrence wins
+            lineIndex = static_cast<std::uint32_t>(offset);
+        }
+
+        // The first occurrence of a key wins. A value left by reparse(...) is kept if unchanged.
+        Prop& prop = propAt(id);
+        bool earlier = options.lazy && prop.present && !prop.modified && lineIndex < prop.line;
+        if (!prop.present || earlier)
+        {
+            if (!prop.present)
+            {
+                prop.present = true;
+                count++;
+                addToFilter(id);
+            }
+
+            prop.line = lineIndex;
+            if (property.value)
+                prop.value = *property.value;
+            else if (prop.value.view() != value)
+                prop.value = options.internValues ? valuePool.intern(value) : detail::Value(value, resource());
+        }
+    }
+
+    /**
+     * @param line A line of inputBuffer
+     * @return The template of the library a template variable refers to, or nullptr
+     *         if the line isn't such a variable
+     */
+    inline const TemplateLibrary::Template* referencedTemplate(std::string_view line)
+    {
+        if (references.empty() || !isTemplateVariable(line))
+            return nullptr;
+
+        std::size_t offset = static_cast<std::size_t>(line.data() - inputBuffer.data());
+        if (!std::binary_search(references.begin(), references.end(), offset))
+            return nullptr;
+
+        std::string_view trimmed = trim(line);
+        std::string_view name = trimmed.substr(1, trimmed.size() - 2);
+
+        const TemplateLibrary::Template* referenced = templateLibrary ? templateLibrary->find(name) : nullptr;
+        if (!referenced)
+            throw std::runtime_error("Template variable is not defined: " + std::string(name));
+
+        return referenced;
+    }
+
+    /**
+     * Add the lexed lines of a library template or an included file, as parseLines(...) would add its text
+     *
+     * @param referenced The template
+     * @param offset Position of the template variable or include directive in inputBuffer
+     */
+    inline void spliceTemplate(const TemplateLibrary::Template& referenced, std::size_t offset, ParseState& state)
+    {
+        using Record = TemplateLibrary::Record;
+        const std::pmr::vector<Record>& records = referenced.records;
+
+        // The lines of all instantiations share the text of the template
+        std::size_t base = storesLines() ? templateText(referenced) : 0;
+
+        for (std::size_t index = 0; index < records.size(); index++)
+        {
+            const Record& record = records[index];
+
+            if (record.type == TemplateLibrary::Comment)
+            {
+                if (storesLines())
+                {
+                    Line& entry = addLine(LineType::Comment);
+                    entry.offset = base + record.offset;
+                    entry.length = record.length;
+                }
+            }
+            else if (record.type == TemplateLibrary::Empty)
+            {
+                if (storesLines())
+                    addLine(LineType::Empty);
+            }
+            else if (record.type == TemplateLibrary::BlockStart)
+            {
+                // Blocks of templates are closed within the template, so they're never deferred
+                if (state.skipNextBlock)
+                {
+                    state.skipNextBlock = skipBlock(records, index);
+                    continue;
+                }
+
+                if (storesLines())
+                    addLine(LineType::BlockStart);
+
+                if (state.prefix != detail::NoKey)
+                    prefixStack.push_back(state.prefix);
+            }
+            else if (record.type == TemplateLibrary::BlockEnd)
+            {
+                if (storesLines())
+                    addLine(LineType::BlockEnd);
+
+                if (!prefixStack.empty())
+                    prefixStack.pop_back();
+            }
+            else
+            {
+                PropertyLine property;
+                property.key = record.key;
+                property.lacksAssignment = record.lacksAssignment;
+                property.continuations = record.continuations;
+                property.value = &record.value;
+                property.format = base + record.offset;
+
+                std::string_view format(referenced.text.data() + record.offset, record.length);
+                property.beforeKey = format.substr(0, record.beforeKey);
+                property.afterKey = format.substr(record.beforeKey, record.afterKey);
+                property.beforeValue = format.substr(record.beforeKey + record.afterKey, record.beforeValue);
+                property.afterValue = format.substr(record.length - record.afterValue);
+
+                detail::KeyId parent = prefixStack.empty() ? detail::NoKey : prefixStack.back();
+                if (admit(property.key, property.lacksAssignment, parent, state))
+                    addProperty(property, parent, record.value.view(), offset, state);
+
+                // The key isn't part of inputBuffer, so a block it prefixes can't be deferred
+                state.topLevelPrefix = false;
+            }
+        }
+    }
+
+    /**
+     * Record a top level block for parsing on first access, in lazy mode
+     *
+     * @param prefix Prefix of the block
+     * @param key Prefix as written, which is part of inputBuffer
+     * @param block Lines of the block after {, up to and including the closing }
+     */
+    inline void deferBlock(detail::KeyId prefix, std::string_view key, std::string_view block)
+    {
+        std::uint32_t segment = blockSegments.intern(key.substr(0, key.find('.')));
+        if (segment >= blockHeads.size())
+            blockHeads.resize(segment + 1, NoBlock);
+
+        blocks.push_back({static_cast<std::size_t>(key.data() - inputBuffer.data()), key.size(),
+                          static_cast<std::size_t>(block.data() - inputBuffer.data()), block.size(),
+                          prefix, blockHeads[segment], true});
+        blockHeads[segment] = static_cast<std::uint32_t>(blocks.size() - 1);
+        pendingBlocks++;
+    }
+
+    /**
+     * Parse the deferred blocks which may hold the key
+     *
+     * Lookups are const, but parsing a block updates the instance. The instance
+     * itself was never const, as blocks are only deferred by parse(...). There's
+     * no locking, so const lookups of a lazy instance must not run concurrently;
+     * see Options::lazy.
+     */
+    inline void materialize(std::string_view key) const
+    {
+        if (pendingBlocks > 0)
+            const_cast<Properties*>(this)->materializeBlocks(key, false);
+    }
+
+    /**
+     * Parse the deferred blocks whose prefix starts with a segment
+     */
+    inline void materializeSegment(std::string_view segment) const
+    {
+        if (pendingBlocks > 0)
+            const_cast<Properties*>(this)->materializeBlocks(segment, true);
+    }
+
+    /**
+     * Parse all deferred blocks
+     */
+    inline void materializeAll() const
+    {
+        if (pendingBlocks > 0)
+        {
+            Properties* self = const_cast<Properties*>(this);
+            for (std::size_t index = 0; index < blocks.size(); index++)
+            {
+                if (blocks[index].pending)
+                    self->materializeBlock(index);
+            }
+        }
+    }
+
+    /**
+     * @param key Key, or the first segment of keys if anyUnder is true
+     * @param anyUnder If true, parse all blocks starting with the segment
+     */
+    inline void materializeBlocks(std::string_view key, bool anyUnder)
+    {
+        std::uint32_t segment = blockSegments.find(key.substr(0, key.find('.')));
+        if (segment == detail::NoKey)
+            return;
+
+        for (std::uint32_t index = blockHeads[segment]; index != NoBlock; index = blocks[index].next)
+        {
+            const Block& block = blocks[index];
+            if (block.pending && (anyUnder || isUnder(key, inputBuffer.substr(block.keyOffset, block.keyLength))))
+                materializeBlock(index);
+        }
+    }
+
+    inline void materializeBlock(std::size_t index)
+    {
+        Block& block = blocks[index];
+        block.pending = false;
+        pendingBlocks--;
+
+        prefixStack.clear();
+        prefixStack.push_back(block.prefix);
+        parseLines(std::string_view(inputBuffer).substr(block.offset, block.length));
+        prefixStack.clear();
+
+        valuePool.clear();
+    }
+
+    inline void clearBlocks()
+    {
+        blocks.clear();
+        blockSegments.clear();
+        blockHeads.clear();
+        pendingBlocks = 0;
+    }
+
+    /**
+     * @return false if no lines are kept, in read-only or lazy mode or when parsing is filtered
+     */
+    inline bool storesLines() const
+    {
+        return !options.readOnly && !options.lazy && options.include.empty() && options.exclude.empty();
+    }
+
+    /** How a key relates to the include and exclude prefixes */
+    enum class Selection
+    {
+        /** The property is kept */
+        Selected,
+
+        /** The key is skipped, but is the prefix of an included key */
+        Ancestor,
+
+        /** The key and all keys under it are skipped */
+        Skipped
+    };
+
+    /**
+     * Match a key against the include and exclude prefixes
+     *
+     * @param key Key as written on the line
+     * @param parent Prefix of the enclosing block, or NoKey
+     */
+    inline Selection select(std::string_view key, detail::KeyId parent)
+    {
+        keyBuffer.clear();
+        if (parent != detail::NoKey)
+        {
+            keyPool->append(keyBuffer, parent);
+            keyBuffer.push_back('.');
+        }
+        keyBuffer.append(key);
+
+        std::string_view full = keyBuffer;
+        for (const std::string& prefix : options.exclude)
+        {
+            if (isUnder(full, prefix))
+                return Selection::Skipped;
+        }
+
+        if (options.include.empty())
+            return Selection::Selected;
+
+        Selection selection = Selection::Skipped;
+        for (const std::string& prefix : options.include)
+        {
+            if (isUnder(full, prefix))
+                return Selection::Selected;
+
+            if (isUnder(prefix, full))
+                selection = Selection::Ancestor;
+        }
+
+        return selection;
+    }
+
+    /**
+     * @return true if the key equals the prefix or starts with the prefix followed by a dot
+     */
+    static inline bool isUnder(std::string_view key, std::string_view prefix)
+    {
+        return key.substr(0, prefix.size()) == prefix && (key.size() == prefix.size() || key[prefix.size()] == '.');
+    }
+
+    /**
+     * Skip the continuation lines of a property line which isn't kept
+     */
+    inline void skipContinuation(std::string_view& input, std::string_view line)
+    {
+        std::string_view::size_type assignPos = line.find_first_of("=");
+        if (assignPos == std::string_view::npos || !isMultiLine(trim(line.substr(assignPos + 1))))
+            return;
+
+        while (nextLine(input, line) && isMultiLine(trim(line)))
+            ;
+    }
+
+    /**
+     * Skip a block whose keys are all filtered out, starting after its {. Nesting
+     * is tracked the way parse(...) tracks the prefix stack, so parsing resumes
+     * with the same prefix after the block.
+     *
+     * @return true if the last property line in the block lacks an assignment, and
+     *         would therefore prefix a block following it
+     */
+    inline bool skipBlock(std::string_view& input)
+    {
+        std::size_t depth = 1;
+        bool lacksAssignment = true;
+        std::string_view line;
+
+        while (depth > 0 && nextLine(input, line))
+        {
+            if (isComment(line) || isEmptyLine(line) || isInclude(line))
+                continue;
+
+            if (const TemplateLibrary::Template* referenced = referencedTemplate(line))
+            {
+                // Library templates close the blocks they open
+                if (referenced->hasProperties)
+                    lacksAssignment = referenced->lastLacksAssignment;
+            }
+            else if (isBlockStart(line))
+            {
+                if (lacksAssignment)
+                    depth++;
+            }
+            else if (isBlockEnd(line))
+            {
+                depth--;
+            }
+            else
+            {
+                lacksAssignment = line.find_first_of("=") == std::string_view::npos;
+                skipContinuation(input, line);
+            }
+        }
+
+        return lacksAssignment;
+    }
+
+    /**
+     * Skip a block of a library template whose keys are all filtered out, like
+     * skipBlock(...) does for the input
+     *
+     * @param records Records of the template
+     * @param index Index of the { record, which is advanced to the closing }
+     * @return true if the last property in the block lacks an assignment
+     */
+    inline bool skipBlock(const std::pmr::vector<TemplateLibrary::Record>& records, std::size_t& index)
+    {
+        std::size_t depth = 1;
+        bool lacksAssignment = true;
+
+        while (depth > 0 && ++index < records.size())
+        {
+            const TemplateLibrary::Record& record = records[index];
+
+            if (record.type == TemplateLibrary::BlockStart)
+            {
+                if (lacksAssignment)
+                    depth++;
+            }
+            else if (record.type == TemplateLibrary::BlockEnd)
+            {
+                depth--;
+            }
+            else if (record.type == TemplateLibrary::Property)
+            {
+                lacksAssignment = record.lacksAssignment;
+            }
+        }
+
+        return lacksAssignment;
+    }
+
+    /**
+     * Clear the line text, keeping its capacity unless it's shared with a clone
+     */
+    inline void clearLineText()
+    {
+        if (lineText.shared())
+            lineText = detail::CowPtr<std::pmr::string>(resource());
+        else
+            lineText.own().clear();
+    }
+
+    /** Memoized result of resolve(...) */
+    struct Resolution
+    {
+        /** Generation of the name when resolved */
+        std::uint32_t generation;
+
+        /** Key of the resolved property, or NoKey */
+        detail::KeyId key;
+    };
+
+    /** Template definitions by name */
+    using Templates = std::pmr::unordered_map<std::pmr::string, std::pmr::vector<std::pmr::string>>;
+
+    /** Position of an include directive in inputBuffer, followed by the content of the file */
+    struct IncludeRange
+    {
+        /** Start of the directive line */
+        std::size_t offset;
+
+        /** End of the included content */
+        std::size_t end;
+
+        /** Cached records of the content, which are spliced rather than parsed, or nullptr */
+        std::shared_ptr<const TemplateLibrary::Template> lexed;
+    };
+
+    /** Line numbers of a run of lines in inputBuffer */
+    struct LineRun
+    {
+        /** Start of the run */
+        std::size_t offset;
+
+        /** Line number of the first line of the run in the parsed stream */
+        std::uint32_t number;
+
+        /**
+         * True if the lines are numbered consecutively. Otherwise the lines were expanded
+         * from a single line, such as an include directive, and all have its number.
+         */
+        bool consecutive;
+    };
+
+    /** A file an included unit was read from */
+    struct IncludedFile
+    {
+        /** Canonical path */
+        std::string path;
+
+        std::filesystem::file_time_type mtime;
+        std::uintmax_t size;
+
+        /** Hash of the content */
+        std::uint64_t hash;
+    };
+
+    /** A preprocessed and lexed included file, shared by all instances of the process */
+    struct IncludedUnit
+    {
+        /** Content with templates and nested includes expanded */
+        std::string text;
+
+        /** Templates defined by the file and its includes */
+        std::vector<std::pair<std::string, std::vector<std::string>>> templates;
+
+        /** Positions of template variables in text which are left to the template library */
+        std::vector<std::size_t> references;
+
+        /** The file followed by all files it includes */
+        std::vector<IncludedFile> files;
+
+        /**
+         * The text lexed as a template, or nullptr if it has template variables left to the
+         * library or isn't self-contained. The values are shared by all instances.
+         */
+        std::shared_ptr<const TemplateLibrary::Template> lexed;
+    };
+
+    /** State of preprocessing for include directives */
+    struct IncludeContext
+    {
+        /** Directory relative paths are resolved against, or empty for the working directory */
+        std::filesystem::path dir;
+
+        /** Files being included, outermost first, to detect cycles */
+        std::vector<std::string>& stack;
+
+        /** Receives the files included */
+        std::vector<IncludedFile>& files;
+
+        /** If set, include directives are kept and their positions recorded */
+        std::pmr::vector<IncludeRange>* ranges;
+
+        /** If set, receives the positions of template variables left to the template library */
+        std::pmr::vector<std::size_t>* references;
+
+        /** If set, receives the line numbers of the output */
+        std::pmr::vector<LineRun>* runs;
+
+        /**
+         * If true, all undefined template variables are left to the template library,
+         * as it's only known when the text is parsed
+         */
+        bool deferReferences;
+    };
+
+    /** A top level block deferred in lazy mode. Offsets are into inputBuffer. */
+    struct Block
+    {
+        /** The prefix as written */
+        std::size_t keyOffset;
+        std::size_t keyLength;
+
+        /** Lines after {, up to and including the closing } */
+        std::size_t offset;
+        std::size_t length;
+
+        detail::KeyId prefix;
+
+        /** Next block whose prefix starts with the same segment, or NoBlock */
+        std::uint32_t next;
+
+        /** False once parsed */
+        bool pending;
+    };
+
+    /** Cached expansion of a value with references */
+    struct Interpolation
+    {
+        enum State { Stale, Expanding, Valid };
+
+        detail::Value value;
+        State state = Stale;
+    };
+
+    /** Internal property representation. The key is implied by the position in the property table. */
+    struct Prop
+    {
+        /** Trimmed value */
+        detail::Value value;
+
+        /**
+         * If true, a call to put(...) has modified, or added, this property
+         * since the last call to parse. This affects how text(true) renders the output
+         * for multi-line values. If not modified, a multi line property is kept as-is,
+         * otherwise the property is written on a single line (unless \ markers are
+         * included in the property)
+         */
+        bool modified = false;
+
+        /** False if the slot is unused, or the property has been removed */
+        bool present = false;
+
+        /** Index of the line defining the property, or NoLine in read-only mode */
+        std::uint32_t line = NoLine;
+    };
+
+    /**
+     * @return The property, or nullptr if it doesn't exist
+     */
+    inline const Prop* findProp(std::string_view key) const
+    {
+        return findProp(key, detail::hash(key));
+    }
+
+    /**
+     * Find a property by key and precomputed hash. Absent keys are mostly
+     * rejected by the filter without probing the key pool.
+     */
+    inline const Prop* findProp(std::string_view key, std::uint64_t h) const
+    {
+        return findProp(findId(key, h));
+    }
+
+    /**
+     * @return Key of an existing property, or NoKey
+     */
+    inline detail::KeyId findId(std::string_view key) const
+    {
+        return findId(key, detail::hash(key));
+    }
+
+    inline detail::KeyId findId(std::string_view key, std::uint64_t h) const
+    {
+        materialize(key);
+
+        if (!filter->mayContain(h))
+            return detail::NoKey;
+
+        detail::KeyId id = keyPool->lookup(key, h);
+        return findProp(id) ? id : detail::NoKey;
+    }
+
+    /**
+     * Find the value of a key, consulting the environment overlay first
+     *
+     * @param key Property key
+     * @param value Set to the value if found
+     * @return true if the key exists
+     */
+    template <typename String>
+    inline bool findValue(std::string_view key, String& value) const
+    {
+        std::uint64_t h = detail::hash(key);
+
+        if (const detail::Value* env = environment->find(key, h))
+        {
+            value = env->view();
+            return true;
+        }
+
+        detail::KeyId id = findId(key, h);
+        if (id == detail::NoKey)
+            return false;
+
+        value = valueOf(id);
+        return true;
+    }
+
+    /**
+     * @return Line number of the line defining a property, or 0 if unknown
+     */
+    inline std::uint32_t sourceLine(const Prop& prop) const
+    {
+        return storesLines() && prop.line != NoLine ? lines[prop.line].number : 0;
+    }
+
+    /**
+     * Find the stored value get(...) reads, for binding
+     *
+     * @return The value, or nullptr if the key doesn't exist
+     */
+    inline const detail::Value* findStored(std::string_view key, std::uint64_t h) const
+    {
+        if (const detail::Value* env = environment->find(key, h))
+            return env;
+
+        detail::KeyId id = findId(key, h);
+        if (id == detail::NoKey)
+            return nullptr;
+
+        // An interpolated value is cached as a value of its own
+        if (valueOf(id).data() != props[id].value.view().data())
+            return &interpolations[id].value;
+
+        return &props[id].value;
+    }
+
+    /**
+     * Find the value of a key given as parts, as findValue(key, value) does
+     *
+     * @param parts Parts of the key, which are joined by dots
+     * @param count Number of parts
+     */
+    template <typename String>
+    inline bool findValue(const std::string_view* parts, std::size_t count, String& value) const
+    {
+        if (count == 0)
+            return false;
+
+        // Environment overrides and blocks left to parse are found by the full key
+        if (environment->size() > 0 || pendingBlocks > 0)
+        {
+            std::string key(parts[0]);
+            for (std::size_t part = 1; part < count; part++)
+                key.append(1, '.').append(parts[part]);
+
+            return findValue(key, value);
+        }
+
+        // Continue the hash over the separators, as if the key had been joined
+        std::uint64_t h = detail::hash(parts[0]);
+        for (std::size_t part = 1; part < count; part++)
+            h = detail::hash(parts[part], detail::hash(".", h));
+
+        if (!filter->mayContain(h))
+            return false;
+
+        detail::KeyId id = keyPool->lookup(parts, count, h);
+        if (!findProp(id))
+            return false;
+
+        value = valueOf(id);
+        return true;
+    }
+
+    /**
+     * @return Value of an existing property, interpolated if enabled
+     */
+    inline std::string_view valueOf(detail::KeyId id) const
+    {
+        std::string_view raw = props[id].value.view();
+        if (!options.interpolate || raw.find("${") == std::string_view::npos)
+            return raw;
+
+        if (interpolations.size() < props.size())
+            interpolations.resize(props.size());
+
+        return interpolate(id);
+    }
+
+    /**
+     * Expand the references in a value, recording which keys it depends on
+     *
+     * @return The cached expansion
+     */
+    inline std::string_view interpolate(detail::KeyId id) const
+    {
+        // Entries are accessed by index, as expanding references may grow the table
+        if (interpolations[id].state == Interpolation::Valid)
+            return interpolations[id].value.view();
+
+        if (interpolations[id].state == Interpolation::Expanding)
+            throw std::runtime_error("Cyclic reference in property " + keyPool->str(id));
+
+        interpolations[id].state = Interpolation::Expanding;
+        std::string out;
+
+        try
+        {
+            std::string_view raw = props[id].value.view();
+            std::string_view::size_type start;
+
+            while ((start = raw.find("${")) != std::string_view::npos)
+            {
+                std::string_view::size_type end = raw.find('}', start + 2);
+                if (end == std::string_view::npos)
+                    break;
+
+                std::string_view ref = raw.substr(start + 2, end - start - 2);
+                std::uint64_t h = detail::hash(ref);
+                dependents.emplace(h, id);
+
+                out.append(raw.substr(0, start));
+
+                detail::KeyId refId;
+                if (const detail::Value* env = environment->find(ref, h))
+                    out.append(env->view());
+                else if ((refId = findId(ref, h)) != detail::NoKey)
+                    out.append(valueOf(refId));
+                else
+                    out.append(raw.substr(start, end + 1 - start));
+
+                raw.remove_prefix(end + 1);
+            }
+
+            out.append(raw);
+        }
+        catch (...)
+        {
+            unlink(id);
+            interpolations[id].state = Interpolation::Stale;
+            throw;
+        }
+
+        Interpolation& entry = interpolations[id];
+        entry.value = detail::Value(out, resource());
+        entry.state = Interpolation::Valid;
+        return entry.value.view();
+    }
+
+    /**
+     * Drop the cached expansion of a property which is about to change, along
+     * with the expansions depending on it
+     */
+    inline void invalidateInterpolation(detail::KeyId id)
+    {
+        if (id < interpolations.size() && interpolations[id].state == Interpolation::Valid)
+        {
+            unlink(id);
+            interpolations[id] = Interpolation();
+        }
+
+        if (dependents.empty())
+            return;
+
+        // Expansions referring to this key, whether it existed or not
+        auto range = dependents.equal_range(keyPool->keyHash(id));
+        std::pmr::vector<detail::KeyId> stale(resource());
+        for (auto it = range.first; it != range.second; ++it)
+            stale.push_back(it->second);
+
+        dependents.erase(range.first, range.second);
+
+        for (detail::KeyId dependent : stale)
+            invalidateInterpolation(dependent);
+    }
+
+    /**
+     * Remove the dependency edges recorded when a value was expanded
+     */
+    inline void unlink(detail::KeyId id) const
+    {
+        std::string_view raw = props[id].value.view();
+        std::string_view::size_type start;
+
+        while ((start = raw.find("${")) != std::string_view::npos)
+        {
+            std::string_view::size_type end = raw.find('}', start + 2);
+            if (end == std::string_view::npos)
+                return;
+
+            auto range = dependents.equal_range(detail::hash(raw.substr(start + 2, end - start - 2)));
+            for (auto it = range.first; it != range.second;)
+                it = it->second == id ? dependents.erase(it) : std::next(it);
+
+            raw.remove_prefix(end + 1);
+        }
+    }
+
+    inline void clearInterpolations()
+    {
+        interpolations.clear();
+        dependents.clear();
+    }
+
+    inline const Prop* findProp(detail::KeyId id) const
+    {
+        return (id < props.size() && props[id].present) ? &props[id] : nullptr;
+    }
+
+    /**
+     * Find or add a property for updating. New properties are appended as a line.
+     *
+     * @return The property, marked as modified
+     */
+    inline Prop& update(std::string_view key)
+    {
+        materialize(key);
+
+        detail::KeyId id = intern(key);
+        Prop& prop = propAt(id);
+
+        if (!prop.present)
+        {
+            if (storesLines())
+            {
+                prop.line = static_cast<std::uint32_t>(lines.size());
+
+                // No text is stored; the line is rendered as "key = value"
+                Line& lineEntry = addLine(LineType::Property);
+                lineEntry.key = id;
+                lineEntry.generated = true;
+                lineEntry.afterKey = lineEntry.beforeValue = 1;
+            }
+
+            prop.present = true;
+            count++;
+            addToFilter(id);
+            invalidateResolutions(key);
+        }
+
+        invalidateInterpolation(id);
+        prop.modified = true;
+        return prop;
+    }
+
+    /**
+     * Resolve a name with environment overrides, trying the candidate keys from
+     * the most specific without memoizing
+     */
+    inline std::string resolveOverridden(std::string_view scope, std::string_view name) const
+    {
+        std::string key;
+        for (;;)
+        {
+            key.assign(scope);
+            if (!scope.empty())
+                key.append(1, '.');
+            key.append(name);
+
+            std::string_view value;
+            if (findValue(key, value))
+                return std::string(value);
+
+            if (scope.empty())
+                return std::string();
+
+            std::string_view::size_type dot = scope.rfind('.');
+            scope = dot == std::string_view::npos ? std::string_view() : scope.substr(0, dot);
+        }
+    }
+
+    /**
+     * Find the key resolve(...) returns, using the memoized result if still valid
+     *
+     * @return Key of the resolved property, or NoKey
+     */
+    inline detail::KeyId resolveKey(std::string_view scope, std::string_view name)
+    {
+        // Every candidate key starts with the first segment of the scope or the name
+        materializeSegment(scope.substr(0, scope.find('.')));
+        materializeSegment(name.substr(0, name.find('.')));
+
+        // Start at the deepest interned part of the scope, as no key exists below it
+        detail::KeyId node = detail::NoKey;
+        while (!scope.empty())
+        {
+            std::string_view::size_type dot = scope.find('.');
+            detail::KeyId next = keyPool->child(node, scope.substr(0, dot));
+            if (next == detail::NoKey)
+                break;
+
+            node = next;
+            if (dot == std::string_view::npos)
+                break;
+
+            scope.remove_prefix(dot + 1);
+        }
+
+        std::uint32_t nameId = resolveNames.intern(name);
+        if (nameId >= nameGenerations.size())
+            nameGenerations.resize(nameId + 1, 0);
+
+        std::uint64_t slot = (static_cast<std::uint64_t>(node) << 32) | nameId;
+        auto it = resolutions.find(slot);
+        if (it != resolutions.end() && it->second.generation == nameGenerations[nameId])
+            return it->second.key;
+
+        detail::KeyId found = detail::NoKey;
+        for (detail::KeyId cur = node;; cur = keyPool->parent(cur))
+        {
+            detail::KeyId id = keyPool->find(name, cur);
+            if (findProp(id))
+            {
+                found = id;
+                break;
+            }
+
+            if (cur == detail::NoKey)
+                break;
+        }
+
+        resolutions[slot] = Resolution{nameGenerations[nameId], found};
+        return found;
+    }
+
+    /**
+     * Invalidate memoized resolutions of every name the key ends with
+     *
+     * @param key Fully qualified key of a property which was added or removed
+     */
+    inline void invalidateResolutions(std::string_view key)
+    {
+        if (resolutions.empty())
+            return;
+
+        for (;;)
+        {
+            std::uint32_t nameId = resolveNames.find(key);
+            if (nameId != detail::NoKey)
+                nameGenerations[nameId]++;
+
+            std::string_view::size_type dot = key.find('.');
+            if (dot == std::string_view::npos)
+                return;
+
+            key.remove_prefix(dot + 1);
+        }
+    }
+
+    /**
+     * Add a property which just became present to the filter, rebuilding it if full
+     */
+    inline void addToFilter(detail::KeyId id)
+    {
+        if (filter->full())
+            rebuildFilter(count * 2);
+        else
+            filter.own().insert(keyPool->keyHash(id));
+    }
+
+    /**
+     * Rebuild the filter from the present properties
+     *
+     * @param capacity Number of keys to size the filter for
+     */
+    inline void rebuildFilter(std::size_t capacity)
+    {
+        detail::KeyFilter& f = filter.own();
+        f.reset(std::max<std::size_t>(capacity, MinFilterKeys));
+
+        for (std::size_t id = 0; id < props.size(); id++)
+        {
+            if (props[id].present)
+                f.insert(keyPool->keyHash(static_cast<detail::KeyId>(id)));
+        }
+    }
+
+    /**
+     * Remove all keys from the filter, keeping its capacity unless it's shared with a clone
+     */
+    inline void clearFilter()
+    {
+        if (filter.shared())
+            filter = detail::CowPtr<detail::KeyFilter>(resource());
+        else
+            filter.own().clear();
+    }
+
+    /**
+     * @return The property slot for an interned key, which may not be present yet
+     */
+    inline Prop& propAt(detail::KeyId id)
+    {
+        if (id >= props.size())
+            props.resize(id + 1);
+
+        return props.mutate(id);
+    }
+
+    /**
+     * Intern a key. The key pool is only copied if it's shared with a clone and the key is new.
+     */
+    inline detail::KeyId intern(std::string_view key, detail::KeyId parent = detail::NoKey)
+    {
+        if (keyPool.shared())
+        {
+            detail::KeyId id = keyPool->find(key, parent);
+            if (id != detail::NoKey)
+                return id;
+        }
+
+        return keyPool.own().intern(key, parent);
+    }
+
+    /**
+     * Expands template variables and includes into a buffer
+     *
+     * @param is Input stream
+     * @param os Receives the input with expanded variables
+     * @param ranges If set, each include directive is kept before the included
+     *        content, and the positions are recorded
+     * @param references If set, receives the positions of template variables
+     *        which are kept for the template library
+     * @param runs If set, receives the line numbers of the output
+     * @param dir Directory relative include paths are resolved against, or empty for the working directory
+     */
+    inline void preprocess(std::istream& is, std::pmr::string& os, std::pmr::vector<IncludeRange>* ranges = nullptr,
+                           std::pmr::vector<std::size_t>* references = nullptr, std::pmr::vector<LineRun>* runs = nullptr,
+                           const std::filesystem::path& dir = std::filesystem::path())
+    {
+        Templates vars(resource());
+        std::vector<std::string> stack;
+        std::vector<IncludedFile> files;
+
+        preprocess(is, os, vars, IncludeContext{dir, stack, files, ranges, references, runs, false});
+    }
+
+    inline void preprocess(std::istream& is, std::pmr::string& os, Templates& vars, const IncludeContext& context)
+    {
+        std::pmr::string& line = lineBuffer;
+
+        // Line number of the current line, and whether the last line written continues a run of LineRuns
+        std::uint32_t number = 0;
+        bool numbered = false;
+
+        while (getline(is, line))
+        {
+            number++;
+
+            if (isInclude(line))
+            {
+                std::shared_ptr<const IncludedUnit> unit = loadInclude(includePath(line, context.dir), context.stack);
+
+                // Template definitions of the file are available after the directive
+                for (const auto& definition : unit->templates)
+                {
+                    std::pmr::vector<std::pmr::string>& body = vars[std::pmr::string(definition.first, resource())];
+                    body.assign(definition.second.begin(), definition.second.end());
+                }
+
+                context.files.insert(context.files.end(), unit->files.begin(), unit->files.end());
+
+                std::size_t start = os.size();
+                numberLines(context, start, number, false, numbered);
+
+                if (context.ranges)
+                    os.append(line).append(1, '\n');
+
+                std::size_t textStart = os.size();
+                os.append(unit->text);
+
+                if (context.ranges)
+                    context.ranges->push_back({start, os.size(), unit->lexed});
+
+                if (context.references)
+                {
+                    for (std::size_t reference : unit->references)
+                        context.references->push_back(textStart + reference);
+                }
+            }
+            else if (isTemplateStart(line))
+            {
+                auto trimmed = trim(line);
+                if (trimmed.size() < 3)
+                    throw std::runtime_error("Invalid template definition syntax");
+
+                // Extract template variable name
+                std::pmr::string varname(trimmed.substr(1,trimmed.size()-2), resource());
+                std::pmr::vector<std::pmr::string> templatelines(resource());
+
+                bool endedOK = false;
+                while (getline(is, line))
+                {
+                    number++;
+
+                    if (isTemplateEnd(line))
+                    {
+                        endedOK = true;
+                        break;
+                    }
+                    else
+                        templatelines.push_back(line);
+                }
+
+                if (!endedOK)
+                    throw std::runtime_error("Missing closing tag in template definition");
+
+                vars[varname] = std::move(templatelines);
+                numbered = false;
+            }
+            else if (isTemplateVariable(line))
+            {
+                // Expand template variable
+                auto trimmed = trim(line);
+                if (trimmed.size() < 3)
+                    throw std::runtime_error("Invalid template variable syntax");
+
+                std::pmr::string varname(trimmed.substr(1,trimmed.size()-2), resource());
+
+                auto match = vars.find(varname);
+                if (match != vars.end())
+                {
+                    numberLines(context, os.size(), number, false, numbered);
+
+                    for (const auto& templateline : match->second)
+                        os.append(templateline).append(1, '\n');
+                }
+                else if (context.deferReferences || (templateLibrary && templateLibrary->contains(varname)))
+                {
+                    // The lexed template is added by parse(...)
+                    if (context.references)
+                        context.references->push_back(os.size());
+
+                    numberLines(context, os.size(), number, true, numbered);
+                    os.append(line).append(1, '\n');
+                }
+                else
+                {
+                    throw std::runtime_error(std::string("Template variable is not defined: ") + varname.c_str());
+                }
+            }
+            else
+            {
+                numberLines(context, os.size(), number, true, numbered);
+                os.append(line).append(1, '\n');
+            }
+        }
+    }
+
+    /**
+     * Record the line number of output written by preprocess(...)
+     *
+     * @param offset Position of the output
+     * @param number Line number of the input line
+     * @param consecutive True if the input line is written as is
+     * @param numbered True if the last line written continues a run, which is updated
+     */
+    inline void numberLines(const IncludeContext& context, std::size_t offset, std::uint32_t number,
+                            bool consecutive, bool& numbered)
+    {
+        if (context.runs && (!consecutive || !numbered))
+            context.runs->push_back({offset, number, consecutive});
+
+        numbered = consecutive;
+    }
+
+    /**
+     * Lex the template definitions of a stream into a library
+     *
+     * @param is Input stream
+     * @param library Receives the templates
+     */
+    inline void compileTemplates(std::istream& is, TemplateLibrary& library)
+    {
+        std::pmr::string& line = lineBuffer;
+        std::pmr::string body(resource());
+
+        while (getline(is, line))
+        {
+            if (!isTemplateStart(line))
+                continue;
+
+            auto trimmed = trim(line);
+            if (trimmed.size() < 3)
+                throw std::runtime_error("Invalid template definition syntax");
+
+            std::string name(trimmed.substr(1, trimmed.size() - 2));
+
+            body.clear();
+            bool endedOK = false;
+            while (getline(is, line))
+            {
+                if (isTemplateEnd(line))
+                {
+                    endedOK = true;
+                    break;
+                }
+                else
+                    body.append(line).append(1, '\n');
+            }
+
+            if (!endedOK)
+                throw std::runtime_error("Missing closing tag in template definition");
+
+            // Lex first, so the library is unchanged if the template is invalid
+            TemplateLibrary::Template lexed = lexTemplate(name, body);
+
+            std::uint32_t id = library.names.intern(name);
+            if (id == library.templates.size())
+                library.templates.emplace_back(library.resource());
+
+            library.templates[id] = std::move(lexed);
+        }
+    }
+
+    /**
+     * Lex the body of a template
+     *
+     * @param name Name of the template, for error messages
+     * @param body Lines of the template
+     */
+    inline TemplateLibrary::Template lexTemplate(const std::string& name, std::string_view body)
+    {
+        using Record = TemplateLibrary::Record;
+
+        TemplateLibrary::Template lexed(resource());
+        std::pmr::string& value = valueBuffer;
+        std::string_view line;
+        std::size_t depth = 0;
+
+        while (nextLine(body, line))
+        {
+            // The files would be parsed at every use, and there's no directory to find them in
+            if (isInclude(line))
+                throw std::runtime_error("Include directive in template " + name);
+
+            Record& record = lexed.records.emplace_back(resource());
+
+            if (isComment(line))
+            {
+                record.type = TemplateLibrary::Comment;
+                record.offset = lexed.text.size();
+                record.length = static_cast<std::uint32_t>(line.size());
+                lexed.text.append(line);
+            }
+            else if (isEmptyLine(line))
+            {
+                record.type = TemplateLibrary::Empty;
+            }
+            else if (isBlockStart(line))
+            {
+                // Blocks are skipped and deferred without looking into templates, so they must be self-contained
+                if (!lexed.lastLacksAssignment)
+                    throw std::runtime_error("Block without a prefix in template " + name);
+
+                record.type = TemplateLibrary::BlockStart;
+                depth++;
+            }
+            else if (isBlockEnd(line))
+            {
+                if (depth == 0)
+                    throw std::runtime_error("Unbalanced block in template " + name);
+
+                record.type = TemplateLibrary::BlockEnd;
+                depth--;
+            }
+            else
+            {
+                PropertyLine property;
+                std::string_view::size_type assignPos = lexKey(line, property);
+
+                if (property.lacksAssignment)
+                    value.clear();
+                else
+                    unescape(trim(line.substr(assignPos + 1), property.beforeValue, property.afterValue), value);
+
+                record.continuations = joinValue(body, value);
+                record.type = TemplateLibrary::Property;
+                record.key = property.key;
+                record.value = detail::Value(value, resource());
+                record.lacksAssignment = property.lacksAssignment;
+
+                record.offset = lexed.text.size();
+                record.beforeKey = static_cast<std::uint32_t>(property.beforeKey.size());
+                record.afterKey = static_cast<std::uint32_t>(property.afterKey.size());
+                record.beforeValue = static_cast<std::uint32_t>(property.beforeValue.size());
+                record.afterValue = static_cast<std::uint32_t>(property.afterValue.size());
+                record.length = record.beforeKey + record.afterKey + record.beforeValue + record.afterValue;
+                lexed.text.append(property.beforeKey).append(property.afterKey)
+                          .append(property.beforeValue).append(property.afterValue);
+
+                lexed.hasProperties = true;
+                lexed.lastLacksAssignment = property.lacksAssignment;
+            }
+        }
+
+        if (depth != 0)
+            throw std::runtime_error("Unbalanced block in template " + name);
+
+        return lexed;
+    }
+
+    /**
+     * Destructive replace
+     *
+     * @param str String where the replace will take place
+     * @param from What to replace
+     * @param to Replacement string
+     * @return The updated string (same as str)
+     */
+    inline std::string& replaceAll(std::string& str, const std::string& from, const std::string& to)
+    {
+        size_t start_pos = 0;
+
+        while ((start_pos = str.find(from, start_pos)) != std::string::npos)
+        {
+            str.replace(start_pos, from.length(), to);
+            start_pos += to.length();
+        }
+
+        return str;
+    }
+
     /**
-     * Parse the input stream
+     * Render the properties of an included file which have been updated, as lines
+     * for the file including it. The first occurrence of a key wins, so on reload
+     * they take precedence over the included file.
      *
-     * @param stream Input stream, such as a std::ifstream
+     * @param ss Receives the lines
+     * @param directive Index of the include directive, which the included lines follow
+     * @param indent Indentation of the lines
      */
-    inline void parse(std::istream& stream)
+    inline void renderIncludedUpdates(std::ostream& ss, std::size_t directive, std::string_view indent)
     {
-        // Resolve template variables
-        std::stringstream is = preprocess(stream);
-        std::string line;
-        std::string prefix = "";
+        std::string key;
 
-        while (getline(is, line))
+        for (std::size_t pos = directive + 1; pos < lines.size() && lines[pos].included; pos++)
         {
-            lines.emplace_back(line);
-            Line& lineEntry = lines.back();
+            const Line& entry = lines[pos];
+            if (entry.linetype != LineType::Property)
+                continue;
 
-            if (isComment(line))
+            const Prop* prop = findProp(entry.key);
+            if (!prop || !prop->modified || prop->line != pos)
+                continue;
+
+            key.clear();
+            keyPool->append(key, entry.key, lines[directive].prefix);
+            ss << indent << key << " = " << escape(prop->value.view()) << "\n";
+        }
+    }
+
+    /**
+     * Prepends '\' to leading whitespaces, per Java property spec
+     *
+     * It also replaces newlines with \<nl>
+     */
+    inline std::string escape(std::string_view str)
+    {
+        std::string_view::size_type s = str.find_first_not_of(WS);
+        if (s != std::string_view::npos)
+        {
+            std::ostringstream ss;
+
+            for (int i = 0; i < s; i++)
+                ss << '\\' << str[i];
+
+            std::string substr(str.substr(s));
+            ss << replaceAll(substr, "\n", "\\\n    ");
+
+            return ss.str();
+        }
+
+        return std::string(str);
+    }
+
+    /**
+     * Remove escaping '\' before white spaces
+     *
+     * @param str String to unescape
+     * @param out Receives the unescaped string
+     */
+    inline void unescape(std::string_view str, std::pmr::string& out)
+    {
+        out.clear();
+
+        if (str.size() > 1 && str[0] == '\\')
+        {
+            std::string_view::size_type i = 0;
+            for (; i < str.size()-1; i+=2)
             {
-                lineEntry.linetype = LineType::Comment;
+                if (str[i] == '\\')
+                    out += str[i + 1];
+                else
+                    break;
             }
-            else if (isEmptyLine(line))
+
+            out.append(str.substr(i));
+        }
+        else
+        {
+            out.append(str);
+        }
+    }
+
+    /**
+     * Removes 'single' or "double" quotes around the string. The input must be trimmed.
+     */
+    inline std::string_view unquote(std::string_view str)
+    {
+        if (str.length() > 2 && ((str[0] == '\'' && str[str.length()-1] == '\'')
+                                 || (str[0] == '"' && str[str.length()-1] == '"')))
+        {
+            return str.substr(1, str.length()-2);
+        }
+
+        return str;
+    }
+
+    /**
+     * Replace str with part of itself, such as a trimmed or unquoted view of it
+     */
+    inline void assignPart(std::pmr::string& str, std::string_view part)
+    {
+        std::string_view::size_type pos = part.data() - str.data();
+        str.resize(pos + part.size());
+        str.erase(0, pos);
+    }
+
+    /*
+     * The trim functions return views of their input, which are empty views
+     * at the start of the input when it only consists of white spaces.
+     */
+
+    inline std::string_view trimright(std::string_view str)
+    {
+        std::string_view ignored;
+        return trimright(str, ignored);
+    }
+
+    inline std::string_view trimright(std::string_view str, std::string_view& trimmed)
+    {
+        std::string_view::size_type s = str.find_last_not_of(WS);
+        if (s == std::string_view::npos)
+        {
+            return str.substr(0, 0);
+        }
+
+        trimmed = str.substr(s+1);
+        return str.substr(0, s+1);
+    }
+
+    inline std::string_view trimleft(std::string_view str, std::string_view& trimmed)
+    {
+        std::string_view::size_type s = str.find_first_not_of(WS);
+        if (s == std::string_view::npos)
+        {
+            return str.substr(0, 0);
+        }
+
+        trimmed = str.substr(0,s);
+        return str.substr(s);
+    }
+
+    inline std::string_view trim(std::string_view str)
+    {
+        std::string_view l,r;
+        return trim(str,l,r);
+    }
+
+    /**
+     * Returns the trimmed string, along with what was trimmed off in output
+     * parameters; this is used to preserve formatting.
+     */
+    inline std::string_view trim(std::string_view str, std::string_view& trimmedLeft, std::string_view& trimmedRight)
+    {
+        return trimright(trimleft(str, trimmedLeft), trimmedRight);
+    }
+
+    /**
+     * Read the next line from a buffer, like getline(...) does for streams
+     *
+     * @param input Remaining input; the line and its newline are removed from it
+     * @param line Receives the line, without the newline
+     * @return False if the input is exhausted
+     */
+    static inline bool nextLine(std::string_view& input, std::string_view& line)
+    {
+        if (input.empty())
+            return false;
+
+        std::string_view::size_type pos = input.find('\n');
+        line = input.substr(0, pos);
+        input.remove_prefix(pos == std::string_view::npos ? input.size() : pos + 1);
+
+        return true;
+    }
+
+    /**
+     * Check if str ends with ch. This function will ignore trailing whitespaces.
+     *
+     * @param str String to search
+     * @param ch Check if this character is the last non-whitespace character
+     * @return True if str ends with ch, ignoring whitespaces
+     */
+    inline bool endswith(std::string_view str, char ch)
+    {
+        // This is utf8-safe, since we are scanning backwards and only looking for 7 bit chars.
+        std::string_view::size_type pos = str.find_last_not_of(WS);
+        return (pos == std::string_view::npos) ? false : str[pos] == ch;
+    }
+
+    /**
+     * A left-trimmed line starting with @include, white space and a path. Lines
+     * with an assignment, such as "@include = x", are properties. A path with =
+     * in it must be quoted.
+     */
+    static inline bool isInclude(std::string_view str)
+    {
+        std::string_view::size_type pos = str.find_first_not_of(WS);
+        if (pos == std::string_view::npos || str.substr(pos, 8) != "@include"
+            || str.size() <= pos + 8 || WS.find(str[pos + 8]) == std::string_view::npos)
+        {
+            return false;
+        }
+
+        std::string_view path = str.substr(pos + 8);
+        path.remove_prefix(std::min(path.size(), path.find_first_not_of(WS)));
+        if (path.empty() || path[0] == ':')
+            return false;
+
+        return path[0] == '"' || path[0] == '\'' || path.find('=') == std::string_view::npos;
+    }
+
+    /**
+     * @return Path of an include directive, relative to dir unless absolute
+     */
+    inline std::filesystem::path includePath(std::string_view directive, const std::filesystem::path& dir)
+    {
+        directive = trim(directive);
+        directive.remove_prefix(8);
+
+        std::filesystem::path path(std::string(unquote(trim(directive))));
+        return path.is_absolute() || dir.empty() ? path : dir / path;
+    }
+
+    /**
+     * Load an included file from the process-wide cache, or preprocess, lex and cache it
+     *
+     * @param path Path of the file
+     * @param stack Files being included, outermost first
+     */
+    static inline std::shared_ptr<const IncludedUnit> loadInclude(const std::filesystem::path& path,
+                                                                 std::vector<std::string>& stack)
+    {
+        std::error_code ec;
+        std::string key = std::filesystem::canonical(path, ec).string();
+        if (ec)
+            throw std::runtime_error("Cannot open included file " + path.string());
+
+        if (std::find(stack.begin(), stack.end(), key) != stack.end())
+            throw std::runtime_error("Include cycle at " + key);
+
+        std::shared_ptr<const IncludedUnit> unit;
+        {
+            std::lock_guard<std::mutex> lock(includeMutex());
+            auto it = includeCache().find(key);
+            if (it != includeCache().end())
+                unit = it->second;
+        }
+
+        if (unit)
+        {
+            std::shared_ptr<const IncludedUnit> current = revalidate(unit);
+            if (current == unit)
+                return unit;
+
+            if (current)
             {
-                lineEntry.linetype = LineType::Empty;
+                std::lock_guard<std::mutex> lock(includeMutex());
+                includeCache()[key] = current;
+                return current;
             }
-            else if (isBlockStart(line))
+        }
+
+        // Preprocess the file with a scratch instance. Other threads may do the same
+        // concurrently, in which case the last one is kept.
+        IncludedFile file{key, {}, 0, 0};
+        std::string content;
+        if (!stamp(file) || !readFile(key, content))
+            throw std::runtime_error("Cannot open included file " + key);
+
+        file.hash = detail::hash(content);
+
+        auto built = std::make_shared<IncludedUnit>();
+        built->files.push_back(file);
+
+        Properties scratch;
+        std::pmr::string text(scratch.resource());
+        Templates vars(scratch.resource());
+        std::pmr::vector<std::size_t> references(scratch.resource());
+        std::istringstream is(content);
+
+        stack.push_back(key);
+        scratch.preprocess(is, text, vars, IncludeContext{std::filesystem::path(key).parent_path(), stack, built->files,
+                                                         nullptr, &references, nullptr, true});
+        stack.pop_back();
+
+        built->text.assign(text.data(), text.size());
+        built->references.assign(references.begin(), references.end());
+        for (const auto& definition : vars)
+        {
+            built->templates.emplace_back(std::string(definition.first),
+                                          std::vector<std::string>(definition.second.begin(), definition.second.end()));
+        }
+
+        // Lex the text once for all instances. Files with template variables left to the library, or
+        // with blocks which aren't closed within them, are parsed by each instance instead.
+        if (built->references.empty())
+        {
+            try
             {
-                lineEntry.linetype = LineType::BlockStart;
-                if (!prefix.empty())
-                    prefixStack.push_back(prefix);
+                built->lexed = std::make_shared<const TemplateLibrary::Template>(scratch.lexTemplate(key, built->text));
             }
-            else if (isBlockEnd(line))
+            catch (const std::runtime_error&)
             {
-                lineEntry.linetype = LineType::BlockEnd;
-                if (!prefixStack.empty())
-                    prefixStack.pop_back();
             }
-            else
-            {
-                lineEntry.linetype = LineType::Property;
+        }
+
+        std::lock_guard<std::mutex> lock(includeMutex());
+        includeCache()[key] = built;
+        return built;
+    }
+
+    /**
+     * Check that the files of a cached unit are unchanged. A file whose time stamp
+     * changed is read, and still considered unchanged if its content hash is.
+     *
+     * @return The unit, a copy with updated time stamps, or nullptr if stale
+     */
+    static inline std::shared_ptr<const IncludedUnit> revalidate(const std::shared_ptr<const IncludedUnit>& unit)
+    {
+        std::shared_ptr<IncludedUnit> restamped;
+
+        for (std::size_t index = 0; index < unit->files.size(); index++)
+        {
+            IncludedFile file = unit->files[index];
+            if (!stamp(file))
+                return nullptr;
+
+            if (file.mtime == unit->files[index].mtime && file.size == unit->files[index].size)
+                continue;
+
+            std::string content;
+            if (file.size != unit->files[index].size || !readFile(file.path, content) || detail::hash(content) != file.hash)
+                return nullptr;
+
+            if (!restamped)
+                restamped = std::make_shared<IncludedUnit>(*unit);
+
+            restamped->files[index] = file;
+        }
+
+        if (restamped)
+            return restamped;
+
+        return unit;
+    }
+
+    /**
+     * Read the modification time and size of a file
+     *
+     * @return false if the file doesn't exist
+     */
+    static inline bool stamp(IncludedFile& file)
+    {
+        std::error_code ec;
+        file.mtime = std::filesystem::last_write_time(file.path, ec);
+        if (!ec)
+            file.size = std::filesystem::file_size(file.path, ec);
+
+        return !ec;
+    }
+
+    static inline bool readFile(const std::string& path, std::string& content)
+    {
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+            return false;
+
+        std::ostringstream ss;
+        ss << in.rdbuf();
+        content = ss.str();
+
+        return true;
+    }
+
+    static inline std::mutex& includeMutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    /**
+     * @return Included files of the process by canonical path
+     */
+    static inline std::unordered_map<std::string, std::shared_ptr<const IncludedUnit>>& includeCache()
+    {
+        static std::unordered_map<std::string, std::shared_ptr<const IncludedUnit>> cache;
+        return cache;
+    }
+
+    inline bool isTemplateVariable(std::string_view str)
+    {
+        std::string_view::size_type pos = str.find_first_not_of(WS);
+        return (pos == std::string_view::npos) ? false : str[pos] == '%';
+    }
+
+    inline bool isTemplateStart(std::string_view str)
+    {
+        std::string_view::size_type pos = str.find_first_not_of(WS);
+        return (pos == std::string_view::npos) ? false : str[pos] == '<';
+    }
+
+    inline bool isTemplateEnd(std::string_view str)
+    {
+        std::string_view::size_type pos = str.find_first_not_of(WS);
+        return (pos == std::string_view::npos) ? false : str[pos] == '<' &&  pos+1 < str.size() && str[pos+1] == '/';
+    }
+
+    /**
+     * A left-trimmed line starting with # or ! is a comment
+     */
+    inline bool isComment(std::string_view str)
+    {
+        std::string_view::size_type pos = str.find_first_not_of(WS);
+        return (pos == std::string_view::npos) ? false : str[pos] == '#' || str[pos] == '!';
+    }
+
+    /**
+     * A trimmed line containing only {
+     */
+    inline bool isBlockStart(std::string_view str)
+    {
+        std::string_view::size_type pos = str.find_first_not_of(WS);
+        return (pos == std::string_view::npos) ? false : str[pos] == '{';
+    }
+
+    /**
+     * A trimmed line containing only }
+     */
+    inline bool isBlockEnd(std::string_view str)
+    {
+        std::string_view::size_type pos = str.find_first_not_of(WS);
+        return (pos == std::string_view::npos) ? false : str[pos] == '}';
+    }
+    /**
+     * A right-trimmed line ending with \ is considered a multiline property.
+     */
+    inline bool isMultiLine(std::string_view str)
+    {
+        return endswith(str, '\\');
+    }
+
+    /**
+     * An empty line, or a line consisting only of whitespace
+     */
+    inline bool isEmptyLine(std::string_view str)
+    {
+        return std::all_of(str.begin(), str.end(), [](unsigned char ch) { return std::isspace(ch); });
+    }
 
-                std::string trimmedStr = line;
-                std::string::size_type assignPos = trimmedStr.find_first_of("=");
+    /** Interned keys; the single owner of all key strings */
+    detail::CowPtr<detail::KeyPool> keyPool;
 
-                std::string key;
-                std::string value;
+    /** Properties indexed by KeyId */
+    detail::CowVector<Prop> props;
 
-                // Lines without = are considered keys with empty values. They may also start a prefix block.
-                if (assignPos == std::string::npos)
-                {
-                    prefix = key = trim(trimmedStr.substr(0, assignPos),
-                                        lineEntry.beforeKey, lineEntry.afterKey);
-                    value = "";
-                    lineEntry.lacksAssignment = true;
-                }
-                else
-                {
-                    prefix = "";
-                    key = trim(trimmedStr.substr(0, assignPos), lineEntry.beforeKey, lineEntry.afterKey);
-                    value = unescape(trim(trimmedStr.substr(assignPos + 1),
-                                          lineEntry.beforeValue, lineEntry.afterValue));
-                }
+    /** Filter over the keys of present properties, so most misses skip the key pool */
+    detail::CowPtr<detail::KeyFilter> filter;
 
-                // To avoid having to reparse the line, associate the key of a line with the Line entry
-                lineEntry.bareKey = key;
+    /** Number of present properties */
+    std::size_t count = 0;
 
-                auto prop = std::make_unique<Prop>();
+    /** Values interned during parse, if Options::internValues is set */
+    detail::ValuePool valuePool;
 
-                lineEntry.key = prop->key = prependPrefix(key);
-                prop->value = value;
+    detail::CowVector<Line> lines;
 
-                if (isMultiLine(value))
-                {
-                    // Remove the backslash
-                    prop->value.pop_back();
+    /** Text of the lines; see Line */
+    detail::CowPtr<std::pmr::string> lineText;
 
-                    // Trim at the end and unquote
-                    prop->value = trimright(prop->value);
-                    prop->value = unquote(prop->value);
+    /** Names passed to resolve(...) */
+    detail::StringPool resolveNames;
 
-                    while (getline(is, line))
-                    {
-                        this->lines.emplace_back(line);
-                        this->lines.back().linetype = LineType::MultilineValue;
+    /** Generation of each name, incremented when a key ending with the name is added or removed */
+    std::pmr::vector<std::uint32_t> nameGenerations;
 
-                        std::string theline = trim(line);
-                        if (isMultiLine(theline))
-                        {
-                            theline.pop_back();
-                            if (endswith(theline, '"') || endswith(theline, '\\'))
-                            {
-                                theline = unquote(trimright(theline));
-                            }
+    /** Resolutions by scope and name id */
+    std::pmr::unordered_map<std::uint64_t, Resolution> resolutions;
 
-                            prop->value += theline;
-                        }
-                        else
-                        {
-                            prop->value += unquote(theline);
-                            break;
-                        }
-                    }
-                }
-                else
-                {
-                    prop->value = unquote(prop->value);
-                }
+    /** Expanded values by KeyId, if Options::interpolate is set */
+    mutable std::pmr::vector<Interpolation> interpolations;
 
-                props.insert(std::make_pair(prop->key, std::move(prop)));
-            }
-        }
-    }
+    /** Properties with cached expansions, by the hash of a key they refer to */
+    mutable std::pmr::unordered_multimap<std::uint64_t, detail::KeyId> dependents;
 
-    /**
-     * Expands template variables.
-     *
-     * @note This method could be merged with parse(...) so that even
-     *       template expansions are pretty printed
-     * @param is Input stream
-     * @return Stream with expanded variables
-     */
-    inline std::stringstream preprocess(std::istream& is)
-    {
-        std::stringstream os;
-        std::string line;
-        std::unordered_map<std::string, std::vector<std::string>> vars;
+    /** Environment overrides by key; see loadEnvironment(...) */
+    detail::CowPtr<detail::StringMap> environment;
 
-        while (getline(is, line))
-        {
-            if (isTemplateStart(line))
-            {
-                auto trimmed = trim(line);
-                if (trimmed.size() < 3)
-                    throw std::runtime_error("Invalid template definition syntax");
+    /** Templates referenced by template variables the input doesn't define */
+    std::shared_ptr<const TemplateLibrary> templateLibrary;
 
-                // Extract template variable name
-                std::string varname = trimmed.substr(1,trimmed.size()-2);
-                std::vector<std::string> templatelines;
+    /** Include directives in inputBuffer, by position */
+    std::pmr::vector<IncludeRange> includes;
 
-                bool endedOK = false;
-                while (getline(is, line))
-                {
-                    if (isTemplateEnd(line))
-                    {
-                        endedOK = true;
-                        break;
-                    }
-                    else
-                        templatelines.push_back(line);
-                }
+    /** Positions of references to templateLibrary in inputBuffer */
+    std::pmr::vector<std::size_t> references;
 
-                if (!endedOK)
-                    throw std::runtime_error("Missing closing tag in template definition");
+    /** Line numbers of inputBuffer, by position; only kept if lines are stored */
+    std::pmr::vector<LineRun> lineRuns;
 
-                vars[varname] = templatelines;
-            }
-            else if (isTemplateVariable(line))
-            {
-                // Expand template variable
-                auto trimmed = trim(line);
-                if (trimmed.size() < 3)
-                    throw std::runtime_error("Invalid template variable syntax");
+    /** Line number of the line being parsed, or 0; see Line::number */
+    std::uint32_t currentLine = 0;
 
-                std::string varname = trimmed.substr(1,trimmed.size()-2);
+    /** Position of the text of each library template in lineText, for the current parse */
+    std::pmr::unordered_map<const TemplateLibrary::Template*, std::size_t> templateOffsets;
 
-                auto match = vars.find(varname);
-                if (match == vars.end())
-                    throw std::runtime_error(std::string("Template variable is not defined: ") + varname);
+    /** True while parsing the content of an included file; see Line::included */
+    bool including = false;
 
-                for (auto templateline : match->second)
-                    os << templateline << std::endl;
-            }
-            else
-            {
-                os << line << std::endl;
-            }
-        }
+    /** Blocks deferred in lazy mode */
+    std::pmr::vector<Block> blocks;
 
-        return os;
-    }
+    /** First segments of the prefixes of deferred blocks */
+    detail::StringPool blockSegments;
+
+    /** First deferred block by segment id */
+    std::pmr::vector<std::uint32_t> blockHeads;
+
+    /** Number of blocks not parsed yet */
+    std::size_t pendingBlocks = 0;
+
+    /** Keys of the currently open prefix blocks */
+    std::pmr::vector<detail::KeyId> prefixStack;
+
+    /** Scratch buffers for parsing, kept to reuse their capacity */
+    std::pmr::string inputBuffer;
+    std::pmr::string valueBuffer;
+    std::pmr::string lineBuffer;
+    std::pmr::string keyBuffer;
+    Options options;
+    static constexpr std::string_view WS = " \n\r\t\v\f";
+
+    /** Marks a property without a line */
+    static constexpr std::uint32_t NoLine = std::numeric_limits<std::uint32_t>::max();
+
+    /** White spaces around the key and value of generated lines */
+    static constexpr std::string_view GeneratedFormat = "  ";
+
+    /** Marks the end of a chain of blocks */
+    static constexpr std::uint32_t NoBlock = std::numeric_limits<std::uint32_t>::max();
+
+    /** Smallest number of keys the filter is sized for */
+    static constexpr std::size_t MinFilterKeys = 64;
+
+    friend class LayeredProperties;
+    friend class TemplateLibrary;
+
+    template <typename Config>
+    friend class Binder;
+
+    friend std::vector<Violation> validate(const Properties& props, const Schema& schema);
+};
+
+inline void TemplateLibrary::add(std::istream& stream)
+{
+    Properties scratch(Options(), resource());
+    scratch.compileTemplates(stream, *this);
+}
+
+/**
+ * Stacks several Properties with precedence, such as defaults, site config,
+ * host config and command line overrides. Layers added later take precedence.
+ *
+ * A flattened index of the effective value of every key is kept up to date as
+ * layers change, recomputing only the affected keys. Lookups therefore take a
+ * single probe no matter how many layers there are, and the layer providing
+ * each value is known.
+ *
+ * To keep the index current, layers are only updated through this class.
+ */
+class LayeredProperties
+{
+public:
+
+    /** Returned by layerOf(...) if no layer has the key */
+    static constexpr std::size_t NoLayer = std::numeric_limits<std::size_t>::max();
 
     /**
-     * If a key occurs inside a prefix block, prepend the prefix.
-     *
-     * @param key Key to prepend (original is not changed)
-     * @return Key with prefix, or the original if no prefix is currently active
+     * @param resource Memory resource for the layer table and the effective index
      */
-    std::string prependPrefix(const std::string& key)
-    {
-        if (!prefixStack.empty())
-            return join(prefixStack, ".", true) + key;
-        else
-            return key;
-    }
+    explicit LayeredProperties(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : layers(resource), keyPool(resource), effective(resource)
+    {}
 
     /**
-     * @return true if the key exists
+     * Add a layer with higher precedence than all current layers
+     *
+     * @param layer Properties of the layer
+     * @return Index of the layer
      */
-    bool hasKey(const std::string& key) const
+    inline std::size_t addLayer(Properties layer)
     {
-        return props.find(key) != props.end();
+        layers.push_back(std::move(layer));
+        recompute(layers.back());
+
+        return layers.size() - 1;
     }
 
     /**
-     * Get a property value. The returned value will be trimmed.
+     * Replace a layer, such as after reloading its file. Only keys in the old
+     * or the new layer are recomputed.
      *
-     * Updating the value will preserve whitespaces.
-     *
-     * @param key Property key
-     * @return Property value, or an empty string if the key doesn't exists.
+     * @param index Index of the layer
+     * @param layer New properties of the layer
      */
-    inline std::string get(const std::string& key) const
+    inline void replaceLayer(std::size_t index, Properties layer)
     {
-        std::string res = "";
-
-        auto match = props.find(key);
-        if (match != props.end())
-            res = match->second->value;
+        Properties old = std::move(layers.at(index));
+        layers[index] = std::move(layer);
 
-        return res;
+        recompute(old);
+        recompute(layers[index]);
     }
 
-    inline std::string get(std::string key, std::string defaultValue) const
+    /**
+     * @return Number of layers
+     */
+    inline std::size_t layerCount() const
     {
-        return hasKey(key) ? get(key) : defaultValue;
+        return layers.size();
     }
 
     /**
-     * Returns true if the value is "true", "1" or "yes"
-     *
-     * @param key Property key
-     * @param defaultValue Default value if the key doesn't exist
-     * @return Property value, or an empty string if the key doesn't exists.
+     * @return The layer with the given index
      */
-    inline bool getBool(const std::string& key, bool defaultValue)
+    inline const Properties& layer(std::size_t index) const
     {
-        if (hasKey(key))
-        {
-            std::string val = get(key);
-            return (val == "true" || val == "1" || val == "yes");
-        }
-        else
-            return defaultValue;
+        return layers.at(index);
     }
 
     /**
-     * Update the property value. If the key already exists, attempt to
-     * maintain as much whitespace information as possible (this work is only
-     * done if text() is called; this method simply updates the property value)
+     * Update a property in a layer
      *
+     * @param layer Index of the layer
      * @param key Property key
      * @param value New property value
-     * @return The old key, if any
      */
-    inline std::string put(const std::string& key, const std::string& value)
+    inline void put(std::size_t layer, std::string_view key, std::string_view value)
     {
-        std::string old = "";
-
-        auto match = props.find(key);
-        if (match != props.end())
-        {
-            auto prop = match->second.get();
-            prop->modified = true;
-
-            old = prop->value;
-            prop->value = value;
-        }
-        else
-        {
-            this->lines.emplace_back(key + " = " + value);
-            Line& lineEntry = lines.back();
-            lineEntry.key = lineEntry.bareKey = key;
-            lineEntry.linetype = LineType::Property;
-
-            auto prop = std::make_unique<Prop>();
-            prop->modified = true;
-            prop->key = key;
-            prop->value = value;
-
-            props.insert(std::make_pair(key, std::move(prop)));
-        }
-
-        return old;
+        layers.at(layer).set(key, value);
+        recompute(key);
     }
 
     /**
-     * Remove a property if it exists.
+     * Remove a property from a layer, if it exists
      *
+     * @param layer Index of the layer
      * @param key Property key
      */
-    inline void remove(const std::string& key)
+    inline void remove(std::size_t layer, std::string_view key)
     {
-        auto match = props.find(key);
-        if (match != props.end())
-            props.erase(match);
+        layers.at(layer).remove(key);
+        recompute(key);
     }
 
     /**
-     * Append an empty line
+     * @return true if any layer has the key
      */
-    inline void putEmptyLine()
+    inline bool hasKey(std::string_view key) const
     {
-        lines.emplace_back("");
-        lines.back().linetype = LineType::Empty;
+        return findEntry(key) != nullptr;
     }
 
     /**
-     * Append a comment
-     *
-     * @param comment Comment. If the leading # or ! is missing, it will be added
+     * @return Effective property value, or an empty string if no layer has the key
      */
-    inline void putComment(const std::string& comment)
+    inline std::string get(std::string_view key) const
     {
-        std::string line = trim(comment);
+        const Entry* entry = findEntry(key);
+        return entry ? std::string(entry->value.view()) : std::string();
+    }
 
-        if (!line.empty())
-        {
-            if (line[0] != '#' && line[0] != '!')
-                line.insert(0, "# ");
+    inline std::string get(std::string_view key, std::string_view defaultValue) const
+    {
+        const Entry* entry = findEntry(key);
+        return std::string(entry ? entry->value.view() : defaultValue);
+    }
 
-            lines.emplace_back(line);
-            lines.back().linetype = LineType::Comment;
+    /**
+     * Returns true if the effective value is "true", "1" or "yes"
+     *
+     * @param key Property key
+     * @param defaultValue Default value if no layer has the key
+     */
+    inline bool getBool(std::string_view key, bool defaultValue) const
+    {
+        const Entry* entry = findEntry(key);
+        if (entry)
+        {
+            std::string_view val = entry->value.view();
+            return (val == "true" || val == "1" || val == "yes");
         }
+        else
+            return defaultValue;
     }
 
     /**
-     * @return All keys
+     * @return Index of the layer providing the effective value, or NoLayer
      */
-    inline std::vector<std::string> keys()
+    inline std::size_t layerOf(std::string_view key) const
     {
-        std::vector<std::string> keys(props.size());
-
-        std::transform(props.begin(), props.end(), keys.begin(),
-                  [](auto& pair) { return pair.first; });
-
-        return keys;
+        const Entry* entry = findEntry(key);
+        return entry ? entry->layer : NoLayer;
     }
 
     /**
-     * @return All values
+     * @return Number of distinct keys in all layers
      */
-    inline std::vector<std::string> values()
+    inline std::size_t size() const
     {
-        std::vector<std::string> values(props.size());
+        return count;
+    }
 
-        std::transform(props.begin(), props.end(), values.begin(),
-                       [](auto& pair) { return pair.second.get()->value; });
+private:
 
-        return values;
+    /** Effective value of a key */
+    struct Entry
+    {
+        detail::Value value;
+
+        /** Layer providing the value, or NoEntry if no layer has the key */
+        std::uint32_t layer = NoEntry;
+    };
+
+    static constexpr std::uint32_t NoEntry = std::numeric_limits<std::uint32_t>::max();
+
+    inline const Entry* findEntry(std::string_view key) const
+    {
+        detail::KeyId id = keyPool.find(key);
+        return (id < effective.size() && effective[id].layer != NoEntry) ? &effective[id] : nullptr;
     }
 
     /**
-     * Renders the properties as a string, including any updates. This can be
-     * written to the property file.
-     *
-     * The original property formatting is kept intact, unless prettyPrint is set.
-     *
-     * Pretty printing removes unnecessary white spaces, and multiple blank lines
-     * in a row are collapsed into a single blank line.
-     *
-     * @param prettyPrint If true, the output is pretty printed.
-     * @return Properties as text
+     * Recompute all keys of a layer
      */
-    inline std::string text(bool prettyPrint=false)
+    inline void recompute(const Properties& layer)
     {
-        std::ostringstream ss;
+        for (const auto& entry : layer.entries())
+            recompute(entry.first);
+    }
 
-        Line* prev = nullptr;
-        size_t idx = 0;
-        int prefixDepth = 0;
+    /**
+     * Recompute the effective value of a key, searching from the top layer down
+     */
+    inline void recompute(std::string_view key)
+    {
+        std::uint64_t h = detail::hash(key);
 
-        for (auto& entry : lines)
+        for (std::size_t index = layers.size(); index-- > 0;)
         {
-            switch (entry.linetype)
+            const Properties::Prop* prop = layers[index].findProp(key, h);
+            if (prop)
             {
-                case LineType::Empty:
-                {
-                    // A subtle point is that \r is implicitly preserved for \r\n line endings,
-                    // because \r occurs before \n
-                    if (!prettyPrint || !(prev && prev->linetype == LineType::Empty))
-                        ss << "\n";
+                detail::KeyId id = keyPool.intern(key);
+                if (id >= effective.size())
+                    effective.resize(id + 1);
 
-                    break;
-                }
-                case LineType::Comment:
-                {
-                    ss << (prettyPrint ? trim(entry.line) : entry.line);
-                    ss << "\n";
+                Entry& entry = effective[id];
+                if (entry.layer == NoEntry)
+                    count++;
 
-                    break;
-                }
-                case LineType::Property:
-                {
-                    // The property may have been removed
-                    auto match = props.find(entry.key);
-                    if (match != props.end())
-                    {
-                        if (prettyPrint)
-                        {
-                            // Indent prefix blocks
-                            if (prefixDepth > 0)
-                                ss << std::string(prefixDepth*4, ' ');
+                entry.value = prop->value;
+                entry.layer = static_cast<std::uint32_t>(index);
+                return;
+            }
+        }
 
-                            ss << entry.bareKey;
+        // No layer has the key any more
+        detail::KeyId id = keyPool.find(key);
+        if (id < effective.size() && effective[id].layer != NoEntry)
+        {
+            effective[id] = Entry();
+            count--;
+        }
+    }
 
-                            if (!match->second->value.empty())
-                                ss << " = " << escape(match->second->value);
-                        }
-                        else
-                        {
-                            // Inject whitespaces before and after key, value
-                            ss << entry.beforeKey << entry.bareKey << entry.afterKey;
+    std::pmr::vector<Properties> layers;
 
-                            if (!entry.lacksAssignment || match->second->modified)
-                            {
-                                ss << "=" << entry.beforeValue << escape(match->second->value) << entry.afterValue;
-                            }
-                        }
+    /** Keys of the effective index */
+    detail::KeyPool keyPool;
 
-                        ss << "\n";
-                    }
+    /** Effective values indexed by KeyId */
+    std::pmr::vector<Entry> effective;
 
-                    break;
-                }
-                case LineType::BlockStart:
-                {
-                    ss << std::string(prefixDepth*4, ' ') << "{" << '\n';
-                    prefixDepth++;
+    /** Number of keys with an effective value */
+    std::size_t count = 0;
+};
+
+/**
+ * Fills an application config struct from properties. The fields are described
+ * once, and bind(...) then looks up each key with its precomputed hash and
+ * converts the value in place, without allocating except for string fields.
+ *
+ *     struct ServerConfig
+ *     {
+ *         std::string host;
+ *         int port;
+ *         bool tls;
+ *     };
+ *
+ *     cxxprops::Binder<ServerConfig> binder("server");
+ *     binder.field(&ServerConfig::host, "host", "localhost")
+ *           .field(&ServerConfig::port, "port", 80)
+ *           .field(&ServerConfig::tls, "tls.enabled", false);
+ *
+ *     ServerConfig config;
+ *     binder.bind(props, config);
+ *
+ * Numbers are converted with std::from_chars, and booleans as by getBool(...).
+ * Missing keys set the default, and values which don't convert throw
+ * std::runtime_error. After reloading the properties, rebind(...) only converts
+ * the fields whose value changed.
+ *
+ * Each field takes a single probe of the key table, so binding costs the same
+ * whatever else is under the prefix. Walking the keys under the prefix instead
+ * would visit keys no field asks for, and would have to apply environment
+ * overrides and lazy parsing separately from the lookups.
+ */
+template <typename Config>
+class Binder
+{
+public:
+
+    /**
+     * @param prefix Prefix of all keys, such as "server", or empty
+     */
+    explicit Binder(std::string_view prefix = {}) : prefix(prefix)
+    {}
+
+    /**
+     * Describe a field
+     *
+     * @param member The field, which is a std::string, bool or arithmetic type
+     * @param key Key of the field, relative to the prefix
+     * @param defaultValue Value if the key doesn't exist
+     * @return This binder
+     */
+    template <typename T, typename Default = T>
+    inline Binder& field(T Config::* member, std::string_view key, const Default& defaultValue = Default())
+    {
+        static_assert(std::is_arithmetic<T>::value || std::is_same<T, std::string>::value,
+                      "Fields must be std::string, bool or arithmetic");
+
+        Field& added = fields.emplace_back();
+        added.key = prefix.empty() ? std::string(key) : prefix + "." + std::string(key);
+        added.hash = detail::hash(added.key);
+        added.assign = [member, defaultValue = T(defaultValue)](Config& config, const std::string& key, const detail::Value* value)
+        {
+            if (!value)
+                config.*member = defaultValue;
+            else if (!convert(value->view(), config.*member))
+                throw std::runtime_error("Invalid value for " + key + ": " + std::string(value->view()));
+        };
+
+        return *this;
+    }
 
-                    break;
-                }
-                case LineType::BlockEnd:
-                {
-                    prefixDepth--;
-                    ss << std::string(prefixDepth*4, ' ') << "}" << '\n';
+    /**
+     * Set all fields
+     *
+     * @param props Properties to read, with the same semantics as get(...)
+     * @param config Receives the values
+     */
+    inline void bind(const Properties& props, Config& config)
+    {
+        for (Field& bound : fields)
+            assign(bound, props.findStored(bound.key, bound.hash), config);
+    }
 
-                    break;
-                }
-                default:
-                    break;
-            }
+    /**
+     * Set the fields whose value changed since the last bind(...) or rebind(...)
+     * of the same config. Unchanged values keep their storage when properties are
+     * reparsed, so a field is converted again only if its value was updated.
+     *
+     * @return Number of fields set
+     */
+    inline std::size_t rebind(const Properties& props, Config& config)
+    {
+        std::size_t changed = 0;
+        for (Field& bound : fields)
+        {
+            const detail::Value* value = props.findStored(bound.key, bound.hash);
+            if (value ? bound.present && value->sameAs(bound.value) : !bound.present)
+                continue;
 
-            prev = &entry;
-            idx++;
+            assign(bound, value, config);
+            changed++;
         }
 
-        return ss.str();
+        return changed;
     }
 
 private:
 
-    enum LineType
+    struct Field
     {
-        Property, Comment, Empty, MultilineValue,
-        BlockStart, BlockEnd,
-        TemplateStart, TemplateLine, TemplateEnd
+        /** Full key, and its hash */
+        std::string key;
+        std::uint64_t hash = 0;
+
+        std::function<void(Config&, const std::string&, const detail::Value*)> assign;
+
+        /** The value last assigned, which keeps its storage alive for comparing identity */
+        detail::Value value;
+        bool present = false;
     };
 
-    /** Represents a line in the input, with enough information to preserve formatting */
-    struct Line
+    inline void assign(Field& bound, const detail::Value* value, Config& config)
     {
-        Line(std::string str) : line(str)
-        {}
+        bound.assign(config, bound.key, value);
+        bound.value = value ? *value : detail::Value();
+        bound.present = value != nullptr;
+    }
 
-        /** The line exactly as it occurs in the file */
-        std::string line;
+    template <typename T>
+    static inline bool convert(std::string_view str, T& out)
+    {
+        if constexpr (std::is_same<T, bool>::value)
+        {
+            out = str == "true" || str == "1" || str == "yes";
+            return true;
+        }
+        else if constexpr (std::is_arithmetic<T>::value)
+        {
+            const char* end = str.data() + str.size();
+            std::from_chars_result result = std::from_chars(str.data(), end, out);
+            return result.ec == std::errc() && result.ptr == end;
+        }
+        else
+        {
+            out.assign(str.data(), str.size());
+            return true;
+        }
+    }
 
-        /** Type of line */
-        LineType linetype = LineType::Property;
+    std::string prefix;
+    std::vector<Field> fields;
+};
 
-        /** The key in this line, when type is LineType::Property. This may include a prefix. */
-        std::string key = "";
+/**
+ * A property which doesn't conform to a Schema
+ */
+struct Violation
+{
+    /** Key of the property, or the pattern of a missing required key */
+    std::string key;
+
+    /** Line number of the property, or 0 if unknown; see Properties::Line::number */
+    std::uint32_t line = 0;
 
-        /** The non-prefixed line, as it appears in the file; kept for rendering. */
-        std::string bareKey = "";
+    std::string message;
+};
 
-        /* Format preservation */
+/**
+ * Describes valid keys and values. Rules are compiled into a tree of key
+ * segments as they are added, which validate(...) walks along with the keys
+ * of the properties. Keys sharing a prefix share the matching of it, so each
+ * key costs a lookup per pattern node matching its parent.
+ *
+ *     cxxprops::Schema schema;
+ *     schema.add(cxxprops::Schema::Rule("server.port").integer(1, 65535).required())
+ *           .add(cxxprops::Schema::Rule("server.tls.enabled").boolean())
+ *           .add(cxxprops::Schema::Rule("backend.*.log.level").oneOf({"debug", "info", "warn"}));
+ *
+ *     for (const cxxprops::Violation& violation : cxxprops::validate(props, schema))
+ *         std::cerr << violation.line << ": " << violation.key << ": " << violation.message << "\n";
+ *
+ * A * segment in a pattern matches any single segment. Where several patterns
+ * match a key, its value is checked against the one with a literal segment
+ * where the patterns first differ, so "a.b.*" takes precedence over "a.*.c".
+ * A key counts as present for every required pattern it matches.
+ */
+class Schema
+{
+public:
 
-        std::string beforeKey = "";
-        std::string afterKey = " ";
-        std::string beforeValue = " ";
-        std::string afterValue = "";
+    /** Describes the values of keys matching a pattern */
+    class Rule
+    {
+    public:
 
         /**
-         * The line may contain only a key and lack "=value"
-         * This fact must be recorded for doing unformatted output
+         * @param pattern Dotted key, where a * segment matches any segment
          */
-        bool lacksAssignment = false;
-    };
+        explicit Rule(std::string_view pattern) : pattern(pattern)
+        {}
 
-    /** Internal property representation */
-    struct Prop
-    {
-        /** Trimmed key */
-        std::string key;
+        /**
+         * Values must be integers within the range
+         */
+        inline Rule& integer(std::int64_t min = std::numeric_limits<std::int64_t>::min(),
+                             std::int64_t max = std::numeric_limits<std::int64_t>::max())
+        {
+            type = Type::Integer;
+            integerMin = min;
+            integerMax = max;
+            return *this;
+        }
 
-        /** Trimmed value */
-        std::string value;
+        /**
+         * Values must be numbers within the range
+         */
+        inline Rule& number(double min = std::numeric_limits<double>::lowest(),
+                            double max = std::numeric_limits<double>::max())
+        {
+            type = Type::Number;
+            numberMin = min;
+            numberMax = max;
+            return *this;
+        }
 
         /**
-         * If true, a call to put(...) has modified, or added, this property
-         * since the last call to parse. This affects how text(true) renders the output
-         * for multi-line values. If not modified, a multi line property is kept as-is,
-         * otherwise the property is written on a single line (unless \ markers are
-         * included in the property)
+         * Values must be true, false, yes, no, 1 or 0
          */
-        bool modified = false;
-    };
+        inline Rule& boolean()
+        {
+            type = Type::Boolean;
+            return *this;
+        }
 
-    /**
-     * Destructive replace
-     *
-     * @param str String where the replace will take place
-     * @param from What to replace
-     * @param to Replacement string
-     * @return The updated string (same as str)
-     */
-    inline std::string& replaceAll(std::string& str, const std::string& from, const std::string& to)
-    {
-        size_t start_pos = 0;
+        /**
+         * Values must be one of the given strings
+         */
+        inline Rule& oneOf(std::vector<std::string> values)
+        {
+            allowed = std::move(values);
+            return *this;
+        }
 
-        while ((start_pos = str.find(from, start_pos)) != std::string::npos)
+        /**
+         * At least one key must match the pattern
+         */
+        inline Rule& required(bool isRequired = true)
         {
-            str.replace(start_pos, from.length(), to);
-            start_pos += to.length();
+            mandatory = isRequired;
+            return *this;
         }
 
-        return str;
-    }
+    private:
 
-    /**
-     * Prepends '\' to leading whitespaces, per Java property spec
-     *
-     * It also replaces newlines with \<nl>
-     */
-    inline std::string escape(const std::string& str)
-    {
-        std::string::size_type s = str.find_first_not_of(WS);
-        if (s != std::string::npos)
+        enum class Type
         {
-            std::ostringstream ss;
+            String, Integer, Number, Boolean
+        };
 
-            for (int i = 0; i < s; i++)
-                ss << '\\' << str[i];
+        std::string pattern;
+        Type type = Type::String;
+        bool mandatory = false;
 
-            auto substr = str.substr(s);
-            ss << replaceAll(substr, "\n", "\\\n    ");
+        std::int64_t integerMin = 0;
+        std::int64_t integerMax = 0;
+        double numberMin = 0;
+        double numberMax = 0;
 
-            return ss.str();
-        }
+        std::vector<std::string> allowed;
 
-        return str;
-    }
+        friend class Schema;
+        friend std::vector<Violation> validate(const Properties& props, const Schema& schema);
+    };
+
+    Schema() : nodes(1)
+    {}
 
     /**
-     * Remove escaping '\' before white spaces
+     * Add a rule, replacing a rule with the same pattern
+     *
+     * @return This schema
      */
-    inline std::string unescape(const std::string& str)
+    inline Schema& add(const Rule& rule)
     {
-        if (str.size() > 1 && str[0] == '\\')
+        std::uint32_t node = 0;
+        std::string_view pattern = rule.pattern;
+
+        for (;;)
         {
-            std::ostringstream ss;
+            std::string_view::size_type dot = pattern.find('.');
+            std::string_view segment = pattern.substr(0, dot);
 
-            int i = 0;
-            for (; i < str.size()-1; i+=2)
+            std::uint32_t next = None;
+            if (segment == "*")
             {
-                if (str[i] == '\\')
-                    ss << str[i + 1];
-                else
-                    break;
+                next = nodes[node].wildcard;
+                if (next == None)
+                    next = nodes[node].wildcard = addNode();
+            }
+            else
+            {
+                std::uint64_t edge = edgeKey(node, segments.intern(segment));
+                auto it = edges.find(edge);
+                next = it != edges.end() ? it->second : edges.emplace(edge, addNode()).first->second;
             }
 
-            ss << str.substr(i);
-            return ss.str();
+            node = next;
+
+            if (dot == std::string_view::npos)
+                break;
+
+            pattern.remove_prefix(dot + 1);
         }
-        else
+
+        if (nodes[node].rule == None)
         {
-            return str;
+            nodes[node].rule = static_cast<std::uint32_t>(rules.size());
+            rules.push_back(rule);
         }
-    }
-
-    /**
-     * Removes 'single' or "double" quotes around the string. The input must be trimmed.
-     */
-    inline std::string unquote(const std::string& str)
-    {
-        std::string res = str;
-
-        if (str.length() > 2 && ((str[0] == '\'' && str[str.length()-1] == '\'')
-                                 || (str[0] == '"' && str[str.length()-1] == '"')))
+        else
         {
-            res = str.substr(1, str.length()-2);
+            rules[nodes[node].rule] = rule;
         }
 
-        return res;
+        return *this;
     }
 
-
-    inline std::string trimright(const std::string& str)
+    /**
+     * If set, keys which match no rule are violations, except keys without a
+     * value that prefix a pattern. Other keys are allowed by default.
+     *
+     * @return This schema
+     */
+    inline Schema& strict(bool isStrict = true)
     {
-        std::string ignored;
-        return trimright(str, ignored);
+        strictKeys = isStrict;
+        return *this;
     }
 
-    inline std::string trimright(const std::string& str, std::string& trimmed)
-    {
-        std::string::size_type s = str.find_last_not_of(WS);
-        if (s == std::string::npos)
-        {
-            return "";
-        }
+private:
 
-        trimmed = str.substr(s+1);
-        return str.substr(0, s+1);
-    }
+    static constexpr std::uint32_t None = std::numeric_limits<std::uint32_t>::max();
 
-    inline std::string trimleft(const std::string& str, std::string& trimmed)
+    /** A node of the pattern tree; the root is the first node */
+    struct Node
     {
-        std::string::size_type s = str.find_first_not_of(WS);
-        if (s == std::string::npos)
-        {
-            return "";
-        }
+        /** Node for a * segment */
+        std::uint32_t wildcard = None;
 
-        trimmed = str.substr(0,s);
-        return str.substr(s);
-    }
+        /** Rule of a pattern ending at this node */
+        std::uint32_t rule = None;
+    };
 
-    inline std::string trim(const std::string& str)
+    inline std::uint32_t addNode()
     {
-        std::string l,r;
-        return trim(str,l,r);
+        nodes.emplace_back();
+        return static_cast<std::uint32_t>(nodes.size() - 1);
     }
 
-    /**
-     * Returns the trimmed string, along with what was trimmed off in output
-     * parameters; this is used to preserve formatting.
-     */
-    inline std::string trim(const std::string& str, std::string& trimmedLeft, std::string& trimmedRight)
+    static inline std::uint64_t edgeKey(std::uint32_t node, std::uint32_t segment)
     {
-        return trimright(trimleft(str, trimmedLeft), trimmedRight);
+        return (static_cast<std::uint64_t>(node) << 32) | segment;
     }
 
     /**
-     * Check if str ends with ch. This function will ignore trailing whitespaces.
+     * Match a segment below a node. The literal child is added before the wildcard
+     * child, so nodes are added in order of precedence.
      *
-     * @param str String to search
-     * @param ch Check if this character is the last non-whitespace character
-     * @return True if str ends with ch, ignoring whitespaces
+     * @param node Node matching the parent key
+     * @param segment Id of the segment in segments, or NoKey if no pattern has it
+     * @param matches Receives the nodes matching the key
      */
-    inline bool endswith(const std::string& str, char ch)
+    inline void step(std::uint32_t node, std::uint32_t segment, std::vector<std::uint32_t>& matches) const
     {
-        // This is utf8-safe, since we are scanning backwards and only looking for 7 bit chars.
-        std::string::size_type pos = str.find_last_not_of(WS);
-        return (pos == std::string::npos) ? false : str[pos] == ch;
+        if (segment != detail::NoKey)
+        {
+            auto it = edges.find(edgeKey(node, segment));
+            if (it != edges.end())
+                matches.push_back(it->second);
+        }
+
+        if (nodes[node].wildcard != None)
+            matches.push_back(nodes[node].wildcard);
     }
 
     /**
-     * Joins a vector of string using the supplied separator.
+     * Check a value against a rule
      *
-     * @param vs Vector of strings. If empty, an empty string is returned.
-     * @param sep Separator
-     * @param append If true, the separator will be appended to the final string
-     * @return String joined by separator
+     * @return Description of the violation, or an empty string if the value is valid
      */
-    inline std::string join(std::vector<std::string>& vs, std::string sep, bool append=false)
+    static inline std::string check(const Rule& rule, std::string_view value)
     {
-        if (!vs.empty())
-        {
-            std::string str = std::accumulate(std::next(vs.begin()), vs.end(), vs[0],
-                                            [&](std::string a, std::string b)
-                                            { return a + sep + b; });
+        const char* end = value.data() + value.size();
 
-            if (append && !str.empty())
-                str += sep;
+        if (rule.type == Rule::Type::Integer)
+        {
+            std::int64_t number = 0;
+            std::from_chars_result result = std::from_chars(value.data(), end, number);
+            if (result.ec != std::errc() || result.ptr != end)
+                return "Expected an integer";
 
-            return str;
+            if (number < rule.integerMin || number > rule.integerMax)
+                return outOfRange("an integer", rule.integerMin, rule.integerMax);
         }
+        else if (rule.type == Rule::Type::Number)
+        {
+            double number = 0;
+            std::from_chars_result result = std::from_chars(value.data(), end, number);
+            if (result.ec != std::errc() || result.ptr != end)
+                return "Expected a number";
 
-        return "";
-    }
+            if (number < rule.numberMin || number > rule.numberMax)
+                return outOfRange("a number", rule.numberMin, rule.numberMax);
+        }
+        else if (rule.type == Rule::Type::Boolean)
+        {
+            if (value != "true" && value != "false" && value != "yes" && value != "no" && value != "1" && value != "0")
+                return "Expected true, false, yes, no, 1 or 0";
+        }
 
-    inline bool isTemplateVariable(const std::string& str)
-    {
-        std::string::size_type pos = str.find_first_not_of(WS);
-        return (pos == std::string::npos) ? false : str[pos] == '%';
-    }
+        if (!rule.allowed.empty() && std::find(rule.allowed.begin(), rule.allowed.end(), value) == rule.allowed.end())
+        {
+            std::string message = "Expected one of";
+            for (const std::string& allowed : rule.allowed)
+                message.append(allowed == rule.allowed.front() ? " " : ", ").append(allowed);
 
-    inline bool isTemplateStart(const std::string& str)
-    {
-        std::string::size_type pos = str.find_first_not_of(WS);
-        return (pos == std::string::npos) ? false : str[pos] == '<';
-    }
+            return message;
+        }
 
-    inline bool isTemplateEnd(const std::string& str)
-    {
-        std::string::size_type pos = str.find_first_not_of(WS);
-        return (pos == std::string::npos) ? false : str[pos] == '<' &&  pos+1 < str.size() && str[pos+1] == '/';
+        return std::string();
     }
 
     /**
-     * A left-trimmed line starting with # or ! is a comment
+     * @return Description of a range, leaving out unbounded ends
      */
-    inline bool isComment(const std::string& str)
+    template <typename T>
+    static inline std::string outOfRange(const char* expected, T min, T max)
     {
-        std::string::size_type pos = str.find_first_not_of(WS);
-        return (pos == std::string::npos) ? false : str[pos] == '#' || str[pos] == '!';
-    }
+        std::ostringstream ss;
+        ss << "Expected " << expected;
 
-    /**
-     * A trimmed line containing only {
-     */
-    inline bool isBlockStart(const std::string& str)
-    {
-        std::string::size_type pos = str.find_first_not_of(WS);
-        return (pos == std::string::npos) ? false : str[pos] == '{';
-    }
+        if (min == std::numeric_limits<T>::lowest())
+            ss << " of at most " << max;
+        else if (max == std::numeric_limits<T>::max())
+            ss << " of at least " << min;
+        else
+            ss << " from " << min << " to " << max;
 
-    /**
-     * A trimmed line containing only }
-     */
-    inline bool isBlockEnd(const std::string& str)
-    {
-        std::string::size_type pos = str.find_first_not_of(WS);
-        return (pos == std::string::npos) ? false : str[pos] == '}';
+        return ss.str();
     }
-    /**
-     * A right-trimmed line ending with \ is considered a multiline property.
-     */
-    inline bool isMultiLine(const std::string& str)
+
+    /** Segments of the patterns */
+    detail::StringPool segments;
+
+    std::vector<Node> nodes;
+
+    /** Children of nodes by literal segment; see edgeKey(...) */
+    std::unordered_map<std::uint64_t, std::uint32_t> edges;
+
+    std::vector<Rule> rules;
+    bool strictKeys = false;
+
+    friend std::vector<Violation> validate(const Properties& props, const Schema& schema);
+};
+
+/**
+ * Check properties against a schema in a single pass over the keys. Values are
+ * checked as get(...) would return them, except for environment overrides.
+ *
+ * Line numbers are only known if the properties were parsed with lines kept,
+ * that is without the readOnly, lazy or filtering options.
+ *
+ * @return All violations, in the order the keys were first seen, followed by
+ *         missing required keys
+ */
+inline std::vector<Violation> validate(const Properties& props, const Schema& schema)
+{
+    // Segments of the key pool which haven't been looked up in the schema yet
+    constexpr std::uint32_t Unmapped = detail::NoKey - 1;
+
+    props.materializeAll();
+
+    const detail::KeyPool& keys = *props.keyPool;
+    std::vector<Violation> violations;
+
+    // Schema nodes matching each key, in order of precedence: the nodes of key id
+    // are matches[first[id]] up to matches[first[id + 1]]
+    std::vector<std::uint32_t> matches;
+    std::vector<std::size_t> first(keys.size() + 1);
+    std::vector<std::uint32_t> segments;
+    std::vector<bool> matched(schema.rules.size());
+
+    // Parents are interned before their children, so they're matched first
+    for (detail::KeyId id = 0; id < keys.size(); id++)
     {
-        return endswith(str, '\\');
+        detail::KeyId parent = keys.parent(id);
+        if (parent == detail::NoKey || first[parent] < first[parent + 1])
+        {
+            detail::SegmentId segment = keys.segment(id);
+            if (segment >= segments.size())
+                segments.resize(segment + 1, Unmapped);
+
+            if (segments[segment] == Unmapped)
+                segments[segment] = schema.segments.find(keys.segmentStr(segment));
+
+            // Top level keys are matched below the root
+            if (parent == detail::NoKey)
+            {
+                schema.step(0, segments[segment], matches);
+            }
+            else
+            {
+                for (std::size_t index = first[parent]; index < first[parent + 1]; index++)
+                    schema.step(matches[index], segments[segment], matches);
+            }
+        }
+
+        first[id + 1] = matches.size();
+
+        const Properties::Prop* prop = props.findProp(id);
+        if (!prop)
+            continue;
+
+        std::uint32_t rule = Schema::None;
+        for (std::size_t index = first[id]; index < first[id + 1]; index++)
+        {
+            std::uint32_t candidate = schema.nodes[matches[index]].rule;
+            if (candidate == Schema::None)
+                continue;
+
+            if (rule == Schema::None)
+                rule = candidate;
+
+            matched[candidate] = true;
+        }
+
+        if (rule == Schema::None)
+        {
+            // Keys without a value may prefix a block of keys matching patterns
+            bool prefix = first[id] < first[id + 1] && prop->value.empty();
+            if (schema.strictKeys && !prefix)
+                violations.push_back({keys.str(id), props.sourceLine(*prop), "Unknown key"});
+
+            continue;
+        }
+
+        std::string message = Schema::check(schema.rules[rule], props.valueOf(id));
+        if (!message.empty())
+            violations.push_back({keys.str(id), props.sourceLine(*prop), std::move(message)});
     }
 
-    /**
-     * An empty line, or a line consisting only of whitespace
-     */
-    inline bool isEmptyLine(const std::string& str)
+    for (std::size_t rule = 0; rule < schema.rules.size(); rule++)
     {
-        return std::all_of(str.begin(), str.end(), isspace);
+        if (schema.rules[rule].mandatory && !matched[rule])
+            violations.push_back({schema.rules[rule].pattern, 0, "Missing required key"});
     }
 
-    std::unordered_map<std::string, std::unique_ptr<Prop>> props;
-    std::vector<Line> lines;
-    std::vector<std::string> prefixStack;
-    const std::string WS = " \n\r\t\v\f";
-};
+    return violations;
+}
 
 } // namespace
 
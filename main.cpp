@@ -1,8 +1,731 @@
 #include <iostream>
 #include <fstream>
+#include <map>
+#include <thread>
+#include <memory_resource>
 
 #include "cxxprops.h"
 
+static int failures = 0;
+
+/* Reports a failed feature check */
+static void check(bool condition, const char* what)
+{
+    if (!condition)
+    {
+        std::cout << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+/* Memory resource counting its allocations */
+class CountingResource : public std::pmr::memory_resource
+{
+public:
+
+    std::size_t allocations = 0;
+
+private:
+
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        allocations++;
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override
+    {
+        std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+static cxxprops::Properties parseText(const std::string& text, cxxprops::Options options = {})
+{
+    cxxprops::Properties props(options);
+    std::istringstream in(text);
+    props.parse(in);
+    return props;
+}
+
+static cxxprops::Properties parseFile(const std::string& path, cxxprops::Options options = {})
+{
+    cxxprops::Properties props(options);
+    std::ifstream in(path);
+    props.parse(in);
+    return props;
+}
+
+static std::map<std::string, std::string> entryMap(const cxxprops::Properties& props)
+{
+    std::map<std::string, std::string> res;
+    for (auto [key, value] : props.entries())
+        res.emplace(key, value);
+    return res;
+}
+
+/* Copies of an entry iterator keep their own entry */
+static void testEntryIterators()
+{
+    cxxprops::Properties props = parseText("first = 1\nsecond = 2\n");
+
+    auto it = props.entries().begin();
+    auto copy = it;
+    ++it;
+    check(copy->first == "first" && copy->second == "1", "iterator copy keeps its entry");
+    check(it->first == "second", "iterator advances independently of its copy");
+
+    auto moved = std::move(copy);
+    check(moved->first == "first", "moved iterator keeps its entry");
+
+    copy = it;
+    ++it;
+    check(copy->first == "second" && it == props.entries().end(), "assigned iterator keeps its entry");
+}
+
+/* Clones share storage until either side updates it, also across threads */
+static void testClone(const std::string& dir)
+{
+    cxxprops::Properties props = parseFile(dir + "/t1.props");
+    std::map<std::string, std::string> original = entryMap(props);
+
+    cxxprops::Properties copy = props.clone();
+    copy.put("port", "9000");
+    copy.put("clone.only", "1");
+    copy.remove("str");
+    copy.putComment("clone comment");
+
+    check(entryMap(props) == original && props.text().find("clone comment") == std::string::npos,
+          "updating a clone leaves the original unchanged");
+    check(copy.get("port") == "9000" && copy.hasKey("clone.only") && !copy.hasKey("str"), "clone is updated");
+
+    props.put("original.only", "1");
+    check(!copy.hasKey("original.only"), "updating the original leaves the clone unchanged");
+
+    // Clones dropped and updated on other threads while this one updates its own
+    std::vector<cxxprops::Properties> clones;
+    for (int i = 0; i < 4; i++)
+        clones.push_back(props.clone());
+
+    std::vector<std::thread> threads;
+    std::vector<char> results(clones.size());
+    for (std::size_t i = 0; i < clones.size(); i++)
+    {
+        threads.emplace_back([&clones, &results, i]
+        {
+            cxxprops::Properties& clone = clones[i];
+            for (int n = 0; n < 200; n++)
+                clone.put("thread.key" + std::to_string(n % 20), std::to_string(i));
+
+            results[i] = clone.get("thread.key3") == std::to_string(i) && clone.get("port") == "8443";
+            clone = cxxprops::Properties();
+        });
+    }
+
+    for (int n = 0; n < 200; n++)
+        props.put("thread.key" + std::to_string(n % 20), "main");
+
+    for (std::thread& thread : threads)
+        thread.join();
+
+    check(std::count(results.begin(), results.end(), 0) == 0, "clones are updated on their own threads");
+    check(props.get("thread.key3") == "main", "original is updated while clones are");
+}
+
+static void setEnvironment(const char* name, const char* value)
+{
+#ifdef _WIN32
+    _putenv_s(name, value);
+#else
+    setenv(name, value, 1);
+#endif
+}
+
+/* Environment variables override properties in lookups, resolution and interpolation */
+static void testEnvironment()
+{
+    setEnvironment("CXXPROPS_TEST_SERVER_LOG_LEVEL", "trace");
+    setEnvironment("CXXPROPS_TEST_PORT", "9000");
+
+    cxxprops::Options options;
+    options.interpolate = true;
+    cxxprops::Properties props = parseText("port = 80\nurl = http://host:${port}\nlog.level = info\n"
+                                           "server.alternative.log.level = debug\n", options);
+    props.loadEnvironment("CXXPROPS_TEST_");
+
+    check(props.get("port") == "9000" && props.hasKey("server.log.level"), "environment overrides lookups");
+    check(props.get("url") == "http://host:9000", "environment overrides interpolated references");
+    check(props.resolve("server", "log.level") == "trace", "environment overrides resolution");
+    check(props.resolve("server.alternative", "log.level") == "debug", "more specific keys take precedence in resolution");
+    check(props.resolve("client", "log.level") == "info", "resolution falls back past overrides");
+    check(props.text().find("9000") == std::string::npos, "environment isn't rendered");
+
+    bool thrown = false;
+    try
+    {
+        props.loadEnvironment("");
+    }
+    catch (const std::invalid_argument&)
+    {
+        thrown = true;
+    }
+    check(thrown && props.get("port") == "9000", "empty environment prefix is rejected");
+}
+
+/* Templates of a shared library are instantiated under the current prefix */
+static void testTemplateLibrary(const std::string& dir)
+{
+    auto library = std::make_shared<cxxprops::TemplateLibrary>();
+    std::ifstream templates(dir + "/templates.props");
+    library->add(templates);
+    check(library->size() == 2 && library->contains("log"), "library templates are added");
+
+    cxxprops::Properties props;
+    props.setTemplates(library);
+    std::istringstream in("server\n{\n    %log%\n    %limits%\n}\nclient\n{\n    %log%\n}\n");
+    props.parse(in);
+
+    check(props.get("server.log.level") == "info" && props.get("client.log.file") == "app.log"
+          && props.get("server.max.requests") == "1000", "library templates are instantiated");
+
+    props.put("client.log.level", "debug");
+    std::string text = props.text();
+    check(props.get("server.log.level") == "info" && text.find("level = info") != std::string::npos
+          && text.find("level = debug") != std::string::npos, "instantiations are updated separately");
+
+    bool thrown = false;
+    try
+    {
+        std::istringstream includes("<common>\n@include common.props\n</common>\n");
+        library->add(includes);
+    }
+    catch (const std::runtime_error&)
+    {
+        thrown = true;
+    }
+    check(thrown && !library->contains("common"), "include directives in library templates are rejected");
+
+    // Lexed templates and their shared values come from the resource of the library
+    CountingResource libraryResource;
+    CountingResource defaultResource;
+    std::pmr::memory_resource* previous = std::pmr::set_default_resource(&defaultResource);
+    {
+        cxxprops::TemplateLibrary counted(&libraryResource);
+        std::ifstream again(dir + "/templates.props");
+        counted.add(again);
+        check(counted.size() == 2, "library with a memory resource is built");
+    }
+    std::pmr::set_default_resource(previous);
+    check(libraryResource.allocations > 0 && defaultResource.allocations == 0, "library allocates from its memory resource");
+}
+
+/* Included files are resolved against a base directory, and updates of their properties are saved */
+static void testIncludes(const std::string& dir)
+{
+    std::string base = dir + "/include";
+    cxxprops::Properties props;
+    std::ifstream in(base + "/main.props");
+    props.parse(in, base);
+
+    check(props.get("backend.database.host") == "db.local" && props.get("shared") == "1",
+          "included files are resolved against the base directory");
+    check(props.get("backend.log.level") == "info", "templates of included files can be used after the directive");
+
+    std::string text = props.text();
+    check(text.find("@include common/database.props") != std::string::npos && text.find("db.local") == std::string::npos,
+          "included files are rendered as their directive");
+
+    props.put("backend.database.host", "db.remote");
+    text = props.text();
+    check(text.find("    database.host = db.remote\n    @include common/database.props") != std::string::npos, "updated included properties are rendered");
+
+    cxxprops::Properties reloaded;
+    std::istringstream saved(text);
+    reloaded.parse(saved, base);
+    check(reloaded.get("backend.database.host") == "db.remote" && reloaded.get("backend.database.port") == "5432",
+          "updated included properties are saved");
+
+    std::size_t entries = 0;
+    for (auto [key, value] : props.fileEntries())
+        entries += key == "backend.database.host" && value == "db.remote";
+    check(entries == 1, "updated included properties are visited once in file order");
+
+    // Included files are parsed once, and their values are shared by the instances including them
+    cxxprops::Properties again;
+    std::ifstream againIn(base + "/main.props");
+    again.parse(againIn, base);
+    std::string_view first, second;
+    for (auto [key, value] : reloaded.entries())
+        first = key == "backend.database.port" ? value : first;
+    for (auto [key, value] : again.entries())
+        second = key == "backend.database.port" ? value : second;
+    check(second == "5432" && first.data() == second.data(), "included values are shared");
+
+    cxxprops::Properties prefixed;
+    std::istringstream prefixedIn("@include common/prefix.props\n{\n    size = 1\n}\n");
+    prefixed.parse(prefixedIn, base);
+    check(prefixed.get("cache.size") == "1", "blocks after an include directive use its last key as a prefix");
+
+    // Files using templates of the library are parsed by each instance
+    auto library = std::make_shared<cxxprops::TemplateLibrary>();
+    std::ifstream templates(dir + "/templates.props");
+    library->add(templates);
+    cxxprops::Properties referencing;
+    referencing.setTemplates(library);
+    std::istringstream referencingIn("@include common/logging.props\n");
+    referencing.parse(referencingIn, base);
+    check(referencing.get("logging.log.level") == "info", "included files use the template library of the instance");
+
+    // Lines which merely start with @include are properties
+    cxxprops::Properties notIncludes = parseText("@include = x\n@include : y\n@include path=z\n");
+    check(notIncludes.get("@include") == "x" && notIncludes.get("@include path") == "z" && notIncludes.size() == 3,
+          "lines with an assignment aren't include directives");
+
+    // Removals can't be expressed without rewriting the included file
+    props.remove("backend.database.port");
+    cxxprops::Properties removed;
+    std::istringstream removedText(props.text());
+    removed.parse(removedText, base);
+    check(!props.hasKey("backend.database.port") && removed.get("backend.database.port") == "5432",
+          "removed included properties return on reload");
+}
+
+/* Groups look keys up relative to a prefix */
+static void testGroups()
+{
+    for (bool lazy : {false, true})
+    {
+        cxxprops::Options options;
+        options.lazy = lazy;
+        cxxprops::Properties props = parseText("backend\n{\n    database\n    {\n        host = db\n        log.level = warn\n    }\n}\n"
+                                               "port = 80\n", options);
+
+        auto database = props.group("backend.database");
+        check(database.get("host") == "db" && database.group("log").get("level") == "warn", "group lookups");
+        check(!database.hasKey("port") && database.get("missing", "default") == "default", "group misses");
+
+        auto root = props.group("");
+        check(root.get("port") == "80" && root.group("backend").group("database").get("host") == "db"
+              && root.group("").prefix().empty(), "empty prefix groups hold all properties");
+        check(props.group("backend").group("").get("database.host") == "db", "empty sub group is the group itself");
+    }
+}
+
+struct ServerConfig
+{
+    std::string host;
+    int port = 0;
+    bool tls = false;
+    double ratio = 0;
+};
+
+/* Config structs are filled from properties, and refilled with the changed fields after a reload */
+static void testBinder()
+{
+    cxxprops::Binder<ServerConfig> binder("server");
+    binder.field(&ServerConfig::host, "host", "localhost")
+          .field(&ServerConfig::port, "port", 80)
+          .field(&ServerConfig::tls, "tls.enabled", false)
+          .field(&ServerConfig::ratio, "ratio", 0.5);
+
+    cxxprops::Properties props = parseText("server\n{\n    host = example.com\n    tls.enabled = yes\n    ratio = 0.25\n}\n");
+
+    ServerConfig config;
+    binder.bind(props, config);
+    check(config.host == "example.com" && config.port == 80 && config.tls && config.ratio == 0.25, "binder fills fields and defaults");
+
+    std::istringstream reload("server\n{\n    host = example.com\n    tls.enabled = yes\n    port = 8080\n}\n");
+    props.reparse(reload);
+    check(binder.rebind(props, config) == 2 && config.port == 8080 && config.ratio == 0.5, "rebind sets the changed fields");
+    check(binder.rebind(props, config) == 0, "rebind without changes sets nothing");
+
+    props.put("server.port", "http");
+    bool thrown = false;
+    try
+    {
+        binder.bind(props, config);
+    }
+    catch (const std::runtime_error&)
+    {
+        thrown = true;
+    }
+    check(thrown, "binder rejects values which don't convert");
+}
+
+/* Layers added later take precedence, and the effective index follows updates */
+static void testLayers()
+{
+    cxxprops::LayeredProperties layered;
+    std::size_t defaults = layered.addLayer(parseText("port = 80\nhost = localhost\nlog.level = info\n"));
+    std::size_t site = layered.addLayer(parseText("port = 8080\n"));
+
+    check(layered.get("port") == "8080" && layered.get("host") == "localhost" && layered.layerOf("port") == site,
+          "top layer takes precedence");
+    check(layered.size() == 3 && !layered.hasKey("missing") && layered.layerOf("missing") == cxxprops::LayeredProperties::NoLayer,
+          "layered keys");
+
+    layered.remove(site, "port");
+    check(layered.get("port") == "80" && layered.layerOf("port") == defaults, "removal exposes the layer below");
+
+    layered.put(defaults, "tls", "yes");
+    check(layered.getBool("tls", false) && layered.size() == 4, "updates of a layer are reflected");
+
+    layered.replaceLayer(site, parseText("host = example.com\n"));
+    check(layered.get("host") == "example.com" && layered.get("log.level") == "info", "replaced layer is reflected");
+
+    layered.replaceLayer(site, parseText(""));
+    check(layered.get("host") == "localhost" && layered.size() == 4, "emptied layer is reflected");
+}
+
+static bool under(const std::string& key, const std::string& prefix)
+{
+    return key.compare(0, prefix.size(), prefix) == 0 && (key.size() == prefix.size() || key[prefix.size()] == '.');
+}
+
+/* Filtered parses keep the keys under included prefixes, except excluded ones */
+static void testFilters(const std::string& dir)
+{
+    cxxprops::Options options;
+    options.include = {"server", "port"};
+    options.exclude = {"server.alternative.log"};
+
+    std::map<std::string, std::string> expected;
+    for (const auto& [key, value] : entryMap(parseFile(dir + "/t1.props")))
+    {
+        if ((under(key, "server") || under(key, "port")) && !under(key, "server.alternative.log"))
+            expected.emplace(key, value);
+    }
+
+    cxxprops::Properties filtered = parseFile(dir + "/t1.props", options);
+    check(entryMap(filtered) == expected, "filtered parse keeps included keys");
+    check(filtered.get("server.alternative.name") == "servername-alt" && !filtered.hasKey("server.alternative.log.level")
+          && !filtered.hasKey("str"), "filtered lookups");
+
+    options.lazy = true;
+    check(entryMap(parseFile(dir + "/t1.props", options)) == expected, "lazy filtered parse keeps included keys");
+}
+
+/* Keys given as segments find the same properties as their joined keys */
+static void testSegments()
+{
+    for (bool lazy : {false, true})
+    {
+        cxxprops::Options options;
+        options.lazy = lazy;
+        cxxprops::Properties props = parseText("tenants\n{\n    acme\n    {\n        log.level = debug\n    }\n}\nport = 80\n", options);
+
+        std::string tenant = "acme";
+        check(props.get({"tenants", tenant, "log", "level"}) == "debug" && props.get({"tenants", tenant, "log.level"}) == "debug"
+              && props.get({"tenants.acme.log.level"}) == "debug" && props.get({"port"}) == "80", "segment lookups");
+        check(props.get({"tenants", "acm", "log.level"}, "none") == "none" && props.get({"tenants.", "acme", "log.level"}, "none") == "none"
+              && !props.hasKey({"tenants", tenant, "log"}) && props.hasKey({"tenants", tenant}) && !props.hasKey({}),
+              "segment misses");
+    }
+}
+
+/* Batches of keys find the same values as lookups one by one */
+static void testGetMany(const std::string& dir)
+{
+    cxxprops::Properties props = parseFile(dir + "/t1.props");
+
+    std::vector<std::string> names;
+    for (auto [key, value] : props.entries())
+    {
+        names.emplace_back(key);
+        names.emplace_back(std::string(key) + ".missing");
+    }
+
+    std::vector<std::string_view> keys(names.begin(), names.end());
+    std::vector<std::optional<std::string_view>> values(keys.size());
+    props.getMany(keys.data(), keys.size(), values.data());
+
+    bool same = true;
+    for (std::size_t i = 0; i < keys.size(); i++)
+        same = same && props.hasKey(keys[i]) == values[i].has_value() && (!values[i] || *values[i] == props.get(keys[i]));
+    check(same && keys.size() > 32, "batched lookups match single lookups");
+
+    auto few = props.getMany({"port", "not.there", "this-key-has-no-value"});
+    check(few.size() == 3 && few[0] == std::string_view("8443") && !few[1] && few[2] && few[2]->empty(), "small batch");
+}
+
+/* Read-only parses keep the same properties without format data */
+static void testReadOnly(const std::string& dir)
+{
+    cxxprops::Options options;
+    options.readOnly = true;
+    cxxprops::Properties props = parseFile(dir + "/t1.props", options);
+
+    check(entryMap(props) == entryMap(parseFile(dir + "/t1.props")), "read-only parse keeps the properties");
+
+    bool thrown = false;
+    try
+    {
+        props.text();
+    }
+    catch (const std::logic_error&)
+    {
+        thrown = true;
+    }
+    check(thrown, "text() of a read-only parse throws");
+
+    props.put("added", "1");
+    props.remove("port");
+    check(props.get("added") == "1" && !props.hasKey("port"), "read-only properties can be updated");
+}
+
+/* Keys sharing segments are interned once, and found whether written in blocks or in full */
+static void testKeyPool()
+{
+    cxxprops::Properties props = parseText("a.b.c = 1\na\n{\n    b\n    {\n        d = 2\n    }\n}\na.b = 3\nb.a = 4\n");
+
+    check(props.get("a.b.c") == "1" && props.get("a.b.d") == "2" && props.get("a.b") == "" && props.get("b.a") == "4",
+          "keys with shared segments");
+    check(!props.hasKey("a.b.e") && !props.hasKey("b") && !props.hasKey("a.b.c.d"), "interned prefixes aren't properties");
+
+    props.remove("a.b.c");
+    props.put("a.b.e", "5");
+    props.put("a.b.c", "6");
+    std::vector<std::string> keys = props.keys();
+    check(props.size() == 6 && std::count(keys.begin(), keys.end(), "a.b.c") == 1 && props.get("a.b.c") == "6",
+          "keys can be removed and added again");
+}
+
+/* Interning equal values doesn't change what's stored */
+static void testInternedValues(const std::string& dir)
+{
+    cxxprops::Options options;
+    options.internValues = true;
+    cxxprops::Properties props = parseFile(dir + "/t1.props", options);
+
+    check(entryMap(props) == entryMap(parseFile(dir + "/t1.props")), "interned values match");
+
+    props = parseText("a = same\nb = same\n", options);
+    props.put("a", "other");
+    check(props.get("a") == "other" && props.get("b") == "same", "updating a shared value leaves the others");
+}
+
+/* All storage of the properties comes from their memory resource */
+static void testMemoryResource(const std::string& dir)
+{
+    CountingResource resource;
+    CountingResource defaultResource;
+    std::pmr::memory_resource* previous = std::pmr::set_default_resource(&defaultResource);
+    {
+        cxxprops::Properties props(cxxprops::Options(), &resource);
+        std::ifstream in(dir + "/t1.props");
+        props.parse(in);
+        props.put("added", "1");
+        props.text();
+        check(props.get("server.log.level") == "debug", "properties with a memory resource are parsed");
+    }
+    std::pmr::set_default_resource(previous);
+
+    check(resource.allocations > 0 && defaultResource.allocations == 0, "properties allocate from their memory resource");
+}
+
+/* Reparsing replaces the properties as a fresh parse would */
+static void testReparse(const std::string& dir)
+{
+    cxxprops::Properties props = parseFile(dir + "/t1.props");
+    props.put("added", "1");
+
+    std::string changed = "port = 9000\nnew.key = x\nserver\n{\n    name = renamed\n}\n";
+    std::istringstream in(changed);
+    props.reparse(in);
+
+    check(entryMap(props) == entryMap(parseText(changed)), "reparse matches a fresh parse");
+    check(props.text() == parseText(changed).text(), "reparse renders as a fresh parse");
+
+    props.reset();
+    check(props.size() == 0 && !props.hasKey("port"), "reset removes all properties");
+}
+
+/* put() returns the old value, and set() stores without returning it */
+static void testPutAndSet()
+{
+    cxxprops::Properties props = parseText("key = old\n");
+
+    check(props.put("key", "new") == "old" && props.put("other", "1").empty(), "put returns the old value");
+
+    std::string key = "built.key";
+    props.set(std::string_view(key), "value");
+    props.set("key", "newer");
+    check(props.get("built.key") == "value" && props.get("key") == "newer", "set stores the value");
+}
+
+/* Properties can be built from ranges of key/value pairs */
+static void testRanges()
+{
+    std::map<std::string, std::string> source;
+    for (int i = 0; i < 300; i++)
+        source.emplace("section" + std::to_string(i % 7) + ".key" + std::to_string(i), std::to_string(i));
+
+    cxxprops::Properties props = cxxprops::Properties::fromRange(source.begin(), source.end());
+    check(entryMap(props) == source, "fromRange stores all pairs");
+
+    std::vector<std::pair<std::string_view, std::string_view>> updates = {{"section1.key1", "changed"}, {"extra", "1"}};
+    props.putAll(updates);
+    check(props.get("section1.key1") == "changed" && props.get("extra") == "1" && props.size() == 301, "putAll updates and adds");
+}
+
+/* Absent keys are rejected, and the filter follows removals and growth */
+static void testAbsentKeys()
+{
+    cxxprops::Properties props;
+    for (int i = 0; i < 2000; i++)
+        props.set("key" + std::to_string(i), std::to_string(i));
+
+    bool found = true;
+    bool absent = true;
+    for (int i = 0; i < 4000; i++)
+    {
+        std::string key = "key" + std::to_string(i);
+        if (i < 2000)
+            found = found && props.get(key, "none") == std::to_string(i);
+        else
+            absent = absent && !props.hasKey(key) && props.get(key, "none") == "none";
+    }
+    check(found && absent, "present keys are found and absent keys aren't");
+
+    for (int i = 0; i < 2000; i += 2)
+        props.remove("key" + std::to_string(i));
+
+    found = true;
+    for (int i = 0; i < 2000; i++)
+        found = found && props.hasKey("key" + std::to_string(i)) == (i % 2 == 1);
+    check(found && props.size() == 1000, "removed keys aren't found");
+
+    props.set("key0", "again");
+    check(props.get("key0") == "again", "removed keys can be added again");
+}
+
+/* Names resolve to the most specific scope, and memoized results follow updates */
+static void testResolve(const std::string& dir)
+{
+    cxxprops::Properties props = parseFile(dir + "/t1.props");
+
+    check(props.resolve("server.alternative", "log.level") == "info" && props.resolve("server.other", "log.level") == "debug"
+          && props.resolve("server.alternative.log.inner.value") == "abc", "names resolve to the most specific scope");
+    check(props.resolve("client", "log.level").empty() && props.resolve("", "port") == "8443", "resolution falls back to the top level");
+
+    props.put("log.level", "warn");
+    check(props.resolve("client", "log.level") == "warn", "added keys are resolved");
+
+    props.remove("server.log.level");
+    check(props.resolve("server.other", "log.level") == "warn", "removed keys are no longer resolved");
+
+    props.put("server.other.log.level", "trace");
+    check(props.resolve("server.other", "log.level") == "trace", "more specific keys are resolved once added");
+}
+
+/* References are expanded on read, and expansions follow updates */
+static void testInterpolation()
+{
+    cxxprops::Options options;
+    options.interpolate = true;
+    cxxprops::Properties props = parseText("host = example.com\nport = 80\nurl = http://${host}:${port}/\n"
+                                           "api = ${url}api\nmissing = ${not.there}\na = ${b}\nb = ${a}\n", options);
+
+    check(props.get("api") == "http://example.com:80/api" && props.get("missing") == "${not.there}", "references are expanded");
+
+    props.put("port", "8080");
+    check(props.get("api") == "http://example.com:8080/api", "expansions follow updates");
+
+    bool thrown = false;
+    try
+    {
+        props.get("a");
+    }
+    catch (const std::runtime_error&)
+    {
+        thrown = true;
+    }
+    check(thrown, "cyclic references throw");
+
+    std::string text = props.text();
+    check(text.find("url = http://${host}:${port}/") != std::string::npos, "text keeps references as written");
+}
+
+/* Lazy parsing yields the same properties as a full parse */
+static void testLazy(const std::string& dir)
+{
+    cxxprops::Options lazy;
+    lazy.lazy = true;
+
+    cxxprops::Properties full = parseFile(dir + "/lazy.props");
+    check(entryMap(parseFile(dir + "/lazy.props", lazy)) == entryMap(full), "lazy parse matches full parse");
+    check(full.hasKey("orphan") && full.hasKey("client.log.level") && full.hasKey("empty.after.empty"), "lazy fixture parses");
+
+    // Lookups materialize only the blocks they need
+    bool same = true;
+    for (auto [key, value] : full.entries())
+        same = same && parseFile(dir + "/lazy.props", lazy).get(key) == value;
+    check(same, "lazy lookups match full parse");
+
+    cxxprops::Properties props = parseText("server\n{\nx = 1\n}\n{\ny = 2\n}\n", lazy);
+    check(props.get("y") == "2" && !props.hasKey("server.y"), "block after a deferred block has no prefix");
+
+    // Blocks left to parse by a parse are kept by the next one
+    cxxprops::Properties twice(lazy);
+    cxxprops::Properties fullTwice;
+    for (const char* text : {"server\n{\nx = 1\n}\n", "client\n{\ny = 2\n}\n"})
+    {
+        std::istringstream lazyIn(text);
+        twice.parse(lazyIn);
+        std::istringstream fullIn(text);
+        fullTwice.parse(fullIn);
+    }
+    check(twice.get("server.x") == "1" && entryMap(twice) == entryMap(fullTwice), "consecutive lazy parses match full parses");
+
+    std::istringstream replacement("client\n{\ny = 3\n}\n");
+    twice.reparse(replacement);
+    check(!twice.hasKey("server.x") && twice.get("client.y") == "3" && twice.size() == 2, "lazy reparse replaces the properties");
+}
+
+static std::string violationText(const std::vector<cxxprops::Violation>& violations)
+{
+    std::string res;
+    for (const cxxprops::Violation& violation : violations)
+        res.append(std::to_string(violation.line)).append(":").append(violation.key).append(";");
+    return res;
+}
+
+/* Schema rules with wildcards, precedence of literal segments and line numbers */
+static void testSchema()
+{
+    using Rule = cxxprops::Schema::Rule;
+
+    cxxprops::Schema schema;
+    schema.add(Rule("a.*.c").integer())
+          .add(Rule("a.b.d"))
+          .add(Rule("x.*.*").boolean())
+          .add(Rule("x.y.*").integer(0, 9))
+          .add(Rule("port").integer(1, 65535).required())
+          .add(Rule("name").required());
+
+    cxxprops::Properties props = parseText("a.b.c = notanint\n"
+                                           "a.b.d = text\n"
+                                           "a.e.c = 5\n"
+                                           "x\n"
+                                           "{\n"
+                                           "    y.z = 10\n"
+                                           "    w.z = maybe\n"
+                                           "}\n"
+                                           "port = 80\n");
+
+    check(violationText(cxxprops::validate(props, schema)) == "1:a.b.c;6:x.y.z;7:x.w.z;0:name;",
+          "schema checks wildcard siblings of literal segments");
+
+    schema.strict();
+    props.put("unknown", "1");
+    check(violationText(cxxprops::validate(props, schema)) == "1:a.b.c;6:x.y.z;7:x.w.z;0:unknown;0:name;",
+          "strict schema reports unknown keys");
+}
+
 /* Test driver */
 int main(int argc, char** args)
 {
@@ -53,6 +776,35 @@ int main(int argc, char** args)
     std::cout << "-----------------------------------------------------------------" << std::endl;
     std::cout << props.text(false) << std::endl;
 
+    std::string dir = std::filesystem::path(args[1]).parent_path().string();
+    if (dir.empty())
+        dir = ".";
+
+    testEntryIterators();
+    testClone(dir);
+    testEnvironment();
+    testTemplateLibrary(dir);
+    testIncludes(dir);
+    testGroups();
+    testBinder();
+    testLayers();
+    testFilters(dir);
+    testSegments();
+    testGetMany(dir);
+    testReadOnly(dir);
+    testKeyPool();
+    testInternedValues(dir);
+    testMemoryResource(dir);
+    testReparse(dir);
+    testPutAndSet();
+    testRanges();
+    testAbsentKeys();
+    testResolve(dir);
+    testInterpolation();
+    testLazy(dir);
+    testSchema();
+
+    std::cout << "Feature checks failed: " << failures << std::endl;
 
-    return 0;
+    return failures == 0 ? 0 : 1;
 }
\ No newline at end of file